@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+#
+# Micro-benchmark of the mixing kernels: calls the init/forward/backward entry
+# points of satnet._cpp and satnet._cuda directly, outside of autograd, over
+# a sweep of shapes.
+#
+#   python benchmarks/bench_mix.py --device cuda --json new.json
+#   python benchmarks/bench_mix.py --device cuda --compare old.json
+#   python benchmarks/bench_mix.py --shapes 64x730x600x32 --dtype bfloat16
+#
+# Every shape reports per-phase times, the sweeps to convergence, GFLOP/s and
+# the bandwidth achieved if every sweep streamed W and S from memory (a model
+# figure: W staying on-chip shows up as more than the device can deliver).
+# --compare prints the speedup over a JSON file of an earlier run, e.g. of
+# another build. With a 16-bit --dtype the deviation of z from the FP32 solve
+# with the same seed is reported as well.
+
+import argparse
+import json
+import sys
+import time
+
+import torch
+
+import satnet
+from satnet.models import get_padded_m
+
+# (B, n, m, k): parity, 4x4 and 9x9 Sudoku (n = 1 + 729 + 300 aux), and
+# square problems to scale m
+DEFAULT_SHAPES = [
+    (64, 42, 128, 8),
+    (256, 42, 128, 8),
+    (64, 365, 200, 32),
+    (40, 1030, 600, 32),
+    (16, 1030, 600, 32),
+    (1, 1030, 600, 32),
+    (32, 512, 2048, 32),
+    (32, 256, 256, 64),
+]
+
+DTYPES = {"float32": torch.float32, "float16": torch.float16, "bfloat16": torch.bfloat16}
+
+
+def parse_shape(s):
+    B, n, m, k = (int(x) for x in s.split("x"))
+    return B, n, m, k
+
+
+class Problem(object):
+    """The buffers MixingFunc would set up for a random S and half of the
+    variables given, on `device`."""
+
+    def __init__(self, B, n, m, k, dtype, device, seed):
+        g = torch.Generator().manual_seed(seed)
+        mp = get_padded_m(m, device == "cuda")
+        S = torch.zeros(n, mp)
+        S[:, :m] = torch.randn(n, m, generator=g) * (0.5 / (n + m)) ** 0.5
+        self.S = S.to(device=device, dtype=dtype)
+        self.is_input = (torch.rand(B, n, generator=g) < 0.5).int()
+        self.is_input[:, 0] = 1
+        self.z0 = torch.rand(B, n, generator=g)
+        self.z0[:, 0] = 1
+        self.V0 = torch.randn(B, n, k, generator=g)
+        self.perm = torch.randperm(n - 1, generator=g).int()
+        self.dz0 = torch.randn(B, n, generator=g)
+        self.is_input, self.z0, self.V0, self.perm, self.dz0 = (
+            t.to(device) for t in (self.is_input, self.z0, self.V0, self.perm, self.dz0)
+        )
+
+        f = dict(device=device)
+        self.shape = (B, n, m, mp, k)
+        self.index = torch.empty(B, n, dtype=torch.int, device=device)
+        self.niter = torch.empty(B, dtype=torch.int, device=device)
+        self.delta0 = torch.zeros(B, **f)
+        self.delta = torch.empty(B, **f)
+        self.invalid = torch.empty(B, dtype=torch.int, device=device)
+        self.bw_niter = torch.empty(B, dtype=torch.int, device=device)
+        self.z, self.V = self.z0.clone(), self.V0.clone()
+        self.W = torch.empty(B, k, mp, **f)
+        self.gnrm = torch.empty(B, n, **f)
+        self.Snrms = torch.empty(n, **f)
+        self.g = torch.empty(B, k, **f)
+        self.dS = torch.empty(n, mp, **f)
+        self.dz = torch.empty(B, n, **f)
+        self.U = torch.empty(B, n, k, **f)
+        self.Phi = torch.empty(B, k, mp, **f)
+
+    def reset(self):
+        self.z.copy_(self.z0)
+        self.V.copy_(self.V0)
+        self.delta0.zero_()
+
+    def init(self, impl):
+        impl.init(self.perm, self.is_input, self.index, self.z, self.V, self.S, self.W, self.Snrms, None)
+
+    def forward(self, impl, max_iter, eps):
+        impl.forward(max_iter, eps, self.index, self.niter, self.delta0, self.delta, self.S, self.z, self.V, self.W,
+                     self.gnrm, self.Snrms, self.g, None)
+
+    def backward(self, impl, prox_lam, math, max_iter, eps):
+        self.dz.copy_(self.dz0)
+        self.U.zero_()
+        self.Phi.zero_()
+        impl.backward(prox_lam, math, max_iter, eps, self.is_input, self.index, self.niter, self.bw_niter, self.invalid,
+                      self.S, self.dS, self.z, self.dz, self.V, self.U, self.W, self.Phi, self.gnrm, self.Snrms, self.g)
+
+
+def timed(fn, device):
+    if device == "cuda":
+        start, end = torch.cuda.Event(enable_timing=True), torch.cuda.Event(enable_timing=True)
+        start.record()
+        fn()
+        end.record()
+        end.synchronize()
+        return start.elapsed_time(end) / 1e3
+    t = time.perf_counter()
+    fn()
+    return time.perf_counter() - t
+
+
+def bench(shape, args, dtype):
+    B, n, m, k = shape
+    device = args.device
+    impl = satnet._cuda if device == "cuda" else satnet._cpp
+    p = Problem(B, n, m, k, dtype, device, args.seed)
+
+    t = {"init": [], "forward": [], "backward": []}
+    for r in range(args.warmup + args.repeat):
+        p.reset()
+        ti = timed(lambda: p.init(impl), device)
+        tf = timed(lambda: p.forward(impl, args.max_iter, args.eps), device)
+        tb = timed(lambda: p.backward(impl, args.prox_lam, args.grad_math, args.max_iter, args.backward_eps), device)
+        if r >= args.warmup:
+            t["init"].append(ti), t["forward"].append(tf), t["backward"].append(tb)
+    t = {phase: sorted(v)[len(v) // 2] for phase, v in t.items()}
+
+    # per instance: a coordinate update is 4*k*m flops (W Si and the rank-1
+    # update of W) and streams W twice and Si once; init is the 2*n*k*m GEMM,
+    # and dS adds 4*n*k*m
+    _, _, _, mp, _ = p.shape
+    nout = (p.index != 0).sum(dim=1).double()
+    sweeps = p.niter.double()
+    updates = (nout * sweeps).sum().item()
+    bw_updates = (nout * p.bw_niter.double()).sum().item()
+    sbytes = p.S.element_size()
+    flops = {
+        "init": 2.0 * B * n * k * mp,
+        "forward": 4.0 * k * mp * updates,
+        "backward": 4.0 * k * mp * bw_updates + 4.0 * B * n * k * mp,
+    }
+    nbytes = {
+        "init": 4.0 * B * (n * k + k * mp) + sbytes * n * mp,
+        "forward": (8.0 * k * mp + sbytes * mp) * updates,
+        "backward": (8.0 * k * mp + sbytes * mp) * bw_updates + 4.0 * B * (2 * n * k + 2 * k * mp) + 4.0 * n * mp,
+    }
+
+    res = {
+        "B": B, "n": n, "m": m, "k": k, "max_iter": args.max_iter, "dtype": args.dtype, "device": device,
+        "eps": args.eps, "backward_eps": args.backward_eps, "grad_precision": args.grad_precision,
+        "prox_lam": args.prox_lam,
+        "niter_mean": sweeps.mean().item(), "niter_max": int(p.niter.max().item()),
+        "bw_niter_mean": p.bw_niter.double().mean().item(),
+        "invalid": int((p.invalid != 0).sum().item()),
+        "time_s": t, "total_s": sum(t.values()),
+        "gflops": {ph: flops[ph] / t[ph] / 1e9 for ph in t},
+        "gbps": {ph: nbytes[ph] / t[ph] / 1e9 for ph in t},
+    }
+    if dtype != torch.float32:
+        # the same solve with S in FP32
+        ref = Problem(B, n, m, k, torch.float32, device, args.seed)
+        ref.init(impl)
+        ref.forward(impl, args.max_iter, args.eps)
+        res["z_max_abs_err_vs_fp32"] = (p.z - ref.z).abs().max().item()
+    return res
+
+
+# the settings that change the work of a run; --compare only pairs results
+# that agree on all of them
+SETTINGS = ("eps", "backward_eps", "grad_precision", "prox_lam")
+
+
+def key(r):
+    return "{B}x{n}x{m}x{k}/{dtype}/{device}/{max_iter}/{eps}/{backward_eps}/{grad_precision}/{prox_lam}".format(**r)
+
+
+def machine(device):
+    if device == "cuda":
+        return {"gpu": torch.cuda.get_device_name()}
+    return {"simd": satnet._cpp.simd_isa()}
+
+
+def load_baseline(path, args):
+    with open(path) as f:
+        run = json.load(f)
+    meta = run.get("meta", {})
+    baseline = {}
+    for r in run["results"]:
+        # results of older runs only carry these settings in meta.args, and
+        # runs before --backward-eps used the forward's sweep count
+        for s in SETTINGS:
+            r.setdefault(s, meta.get("args", {}).get(s, 0.0 if s == "backward_eps" else None))
+        baseline[key(r)] = r
+    for what, v in machine(args.device).items():
+        if meta.get(what, v) != v:
+            print("warning: %s ran on %s %s, this run on %s; speedups compare different hardware"
+                  % (path, what, meta[what], v), file=sys.stderr)
+    for s in SETTINGS:
+        if baseline and all(r[s] != getattr(args, s) for r in baseline.values()):
+            print("warning: %s has no results with %s=%s, nothing to compare"
+                  % (path, s, getattr(args, s)), file=sys.stderr)
+    return baseline
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SATNet mixing kernel benchmark")
+    parser.add_argument("--device", choices=["cpu", "cuda"], default="cuda" if torch.cuda.is_available() else "cpu")
+    parser.add_argument("--shapes", nargs="+", type=parse_shape, default=DEFAULT_SHAPES, help="BxNxMxK ...")
+    parser.add_argument("--dtype", choices=list(DTYPES), default="float32")
+    parser.add_argument("--max-iter", type=int, default=40)
+    parser.add_argument("--eps", type=float, default=1e-4)
+    parser.add_argument("--backward-eps", type=float, default=0.0,
+                        help="stopping threshold of the backward sweeps; 0 runs as many as the forward pass")
+    parser.add_argument("--prox-lam", type=float, default=1e-2)
+    parser.add_argument("--grad-precision", choices=list(satnet.models.GRAD_PRECISIONS), default="fp32")
+    parser.add_argument("--warmup", type=int, default=2)
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--json", help="write the results to this file")
+    parser.add_argument("--compare", help="JSON file of an earlier run to print speedups against")
+    args = parser.parse_args()
+    args.grad_math = satnet.models.GRAD_PRECISIONS[args.grad_precision]
+    if args.device == "cuda" and not torch.cuda.is_available():
+        parser.error("CUDA is not available")
+
+    baseline = load_baseline(args.compare, args) if args.compare else {}
+
+    results = []
+    print("%-22s %6s %9s %9s %9s %8s %8s" % ("BxNxMxK", "niter", "init ms", "fwd ms", "bwd ms", "fwd GF/s", "speedup"))
+    for shape in args.shapes:
+        r = bench(shape, args, DTYPES[args.dtype])
+        results.append(r)
+        t = r["time_s"]
+        speedup = ""
+        if key(r) in baseline:
+            speedup = "%.2fx" % (baseline[key(r)]["total_s"] / r["total_s"])
+        print("%-22s %6.1f %9.3f %9.3f %9.3f %8.1f %8s" % (
+            "x".join(str(x) for x in shape), r["niter_mean"], t["init"] * 1e3, t["forward"] * 1e3,
+            t["backward"] * 1e3, r["gflops"]["forward"], speedup))
+        if "z_max_abs_err_vs_fp32" in r:
+            print("%-22s max |z - z_fp32| = %.2e" % ("", r["z_max_abs_err_vs_fp32"]))
+
+    if args.json:
+        meta = {"torch": torch.__version__, "args": {a: v for a, v in vars(args).items() if a != "shapes"}}
+        meta.update(machine(args.device))
+        with open(args.json, "w") as f:
+            json.dump({"meta": meta, "results": results}, f, indent=1)
+
+
+if __name__ == "__main__":
+    main()
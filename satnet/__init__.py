@@ -1,3 +1,3 @@
-from .models import SATNet
+from .models import SATNet, SATNetEngine, SolverState, SolverStats, solve_grouped
 
-__all__ = ['SATNet']
+__all__ = ['SATNet', 'SATNetEngine', 'SolverState', 'SolverStats', 'solve_grouped']
@@ -1,3 +1,6 @@
+import time
+import weakref
+
 import torch
 import torch.nn as nn
 from torch.autograd import Function
@@ -13,10 +16,191 @@ def get_k(n):
     return int((2 * n) ** 0.5 + 3) // 4 * 4
 
 
+# On CPU the clause dimension is padded with zero clauses up to a whole number
+# of 64-byte lines, so that every row of S, W and Phi starts aligned for the
+# SIMD kernels. Zero clauses change neither W'S_i nor the gradient.
+CPU_M_ALIGN = 16
+
+# math modes of the dS GEMM on CUDA, see MIX_MATH_* in satnet.h
+GRAD_PRECISIONS = {"fp32": 0, "tf32": 1, "fp16": 2}
+
+# storage formats of S inside the solver, see MIX_FP32 in satnet.h
+DTYPES = (torch.float32, torch.float16, torch.bfloat16)
+
+
+def get_padded_m(m, is_cuda):
+    return m if is_cuda else -(-m // CPU_M_ALIGN) * CPU_M_ALIGN
+
+
+# every buffer of an arena starts on a 256-byte boundary
+ARENA_ALIGN = 64
+
+
+class Workspace(object):
+    """Reusable arenas for the MixingFunc buffers.
+
+    Each MixingFunc call takes one arena for the forward buffers, and one for
+    the backward ones, each a single flat allocation that all its buffers are
+    views of. It holds them until its autograd context is freed (right after
+    the call under no_grad, after backward otherwise). They then go back to a
+    pool for the next call of the same shapes, so a training loop stops
+    reallocating and zeroing a dozen buffers per step. Calls still in flight
+    (e.g. a layer applied twice before backward) each get their own arena.
+    Arenas allocated while a CUDA graph is being captured belong to the
+    graph's private memory pool and are never pooled here.
+    """
+
+    # layouts kept, e.g. forward and backward at the full and the last batch size
+    MAX_POOLS = 8
+
+    def __init__(self):
+        self.pools = {}
+
+    def acquire(self, buffers, device):
+        """buffers: list of (name, shape, dtype). Returns an object with one
+        attribute per name; the contents are uninitialized."""
+        key = (tuple(buffers), device)
+        if key not in self.pools:
+            if len(self.pools) >= self.MAX_POOLS:
+                self.pools.clear()
+            layout, size = [], 0
+            for name, shape, dtype in buffers:
+                numel = 1
+                for d in shape:
+                    numel *= d
+                # sized in float32 units, reinterpreted per buffer
+                nfloat = -(-numel * torch.empty((), dtype=dtype).element_size() // 4)
+                layout.append((name, shape, dtype, size, numel, nfloat))
+                size += -(-nfloat // ARENA_ALIGN) * ARENA_ALIGN
+            self.pools[key] = (layout, size, [])
+        layout, size, free = self.pools[key]
+        capturing = torch.cuda.is_available() and torch.cuda.is_current_stream_capturing()
+        buf = free.pop() if free and not capturing else torch.empty(size, device=device)
+
+        arena = _Arena()
+        for name, shape, dtype, offset, numel, nfloat in layout:
+            setattr(arena, name, buf[offset:offset + nfloat].view(dtype)[:numel].view(shape))
+        if not capturing:
+            weakref.finalize(arena, self._release, key, buf)
+        return arena
+
+    def _release(self, key, buf):
+        if key in self.pools:
+            self.pools[key][2].append(buf)
+
+
+class _Arena(object):
+    pass
+
+
+class SolverStats(object):
+    """Telemetry of the solves of a SATNet layer created with stats=True.
+
+    Per sample of the last call (the shards of a split batch concatenated):
+        niter: sweeps of the forward pass.
+        bw_niter: sweeps of the backward pass, see SATNet's backward_eps;
+            -1 before backward.
+        delta0, delta: function decrease of the first and of the last sweep;
+            the solve stopped on eps when delta < eps * delta0.
+        invalid: outcome of the backward pass, see MIX_VALID in satnet.h:
+            0 valid, 1 dropped for an invalid dz (z at 0 or 1, or a
+            vanishing g), 2 dropped for a U that is not finite. A dropped
+            sample gets a zero dz and adds nothing to dS. -1 before backward.
+    tensor() returns them as the columns of a `(batch, 5)` float tensor, and
+    time() the seconds spent in init, forward and backward by the last call.
+    Running totals: calls, samples and invalid_samples().
+
+    Recording costs a few small device copies per call and never
+    synchronizes: the CUDA events and invalid counts are only read when
+    asked for.
+    """
+
+    PHASES = ("init", "forward", "backward")
+    FIELDS = ("niter", "delta0", "delta", "invalid", "bw_niter")
+
+    def __init__(self):
+        self.calls, self.samples = 0, 0
+        # per device, so that counting never synchronizes
+        self._invalid = {}
+        self._shards = []
+
+    def begin(self):
+        self.calls += 1
+        self._shards = []
+
+    def invalid_samples(self):
+        """Samples dropped by a backward pass over all calls."""
+        return sum(int(c) for c in self._invalid.values())
+
+    def tensor(self):
+        cols = []
+        for r in self._shards:
+            cols.append(torch.stack([getattr(r, f).float() for f in self.FIELDS], dim=1).to(self._shards[0].device))
+        return torch.cat(cols) if cols else torch.empty(0, len(self.FIELDS))
+
+    def time(self):
+        """dict phase -> seconds, summed over the shards of the last call."""
+        t = dict.fromkeys(self.PHASES, 0.0)
+        for r in self._shards:
+            for phase, (start, end) in r.marks.items():
+                if isinstance(start, float):
+                    t[phase] += end - start
+                else:
+                    end.synchronize()
+                    t[phase] += start.elapsed_time(end) / 1e3
+        return t
+
+    def _shard(self, B, device):
+        r = _Arena()
+        r.owner, r.device, r.marks = self, device, {}
+        r.invalid = torch.full((B,), -1, dtype=torch.int, device=device)
+        r.bw_niter = torch.full((B,), -1, dtype=torch.int, device=device)
+        self._shards.append(r)
+        self.samples += B
+        return r
+
+    @staticmethod
+    def _mark(device):
+        if device.type == "cuda":
+            ev = torch.cuda.Event(enable_timing=True)
+            ev.record()
+            return ev
+        return time.perf_counter()
+
+
+class _Phase(object):
+    """Times the enclosed launches as `phase` of a SolverStats shard record,
+    or does nothing for None."""
+
+    def __init__(self, rec, phase):
+        self.rec, self.phase = rec, phase
+
+    def __enter__(self):
+        if self.rec is not None:
+            self.start = SolverStats._mark(self.rec.device)
+
+    def __exit__(self, *exc):
+        if self.rec is not None:
+            self.rec.marks[self.phase] = (self.start, SolverStats._mark(self.rec.device))
+
+
 class MixingFunc(Function):
     """Apply the Mixing method to the input probabilities.
 
-    Args: see SATNet.
+    Args: see SATNet, plus the optional warm start
+        V0 of shape `(batch, n, k)`: initial V, e.g. a converged V of an earlier
+            call. Rows of input variables are still set from z.
+        delta0 of shape `(batch,)`: first-sweep decrease of the cold solve
+            that produced V0, which eps is relative to; 0 for a cold start.
+        workspace: a Workspace to take the buffers from, e.g. SATNet's.
+        instance_perm: see SATNet.
+        sparse: see SATNet; requires dtype torch.float32.
+        stats: a SolverStats to record this call into.
+        backward_eps, backward_max_iter: see SATNet.
+
+    Returns: (z, V, delta0), where V and delta0 can seed a later call. They
+        live in the workspace and are overwritten once the arena is reused, so
+        copy them to keep them.
 
     Impl Note:
         The SATNet is a wrapper for the MixingFunc,
@@ -24,78 +208,355 @@ class MixingFunc(Function):
     """
 
     @staticmethod
-    def forward(ctx, S, z, is_input, max_iter, eps, prox_lam):
-        B, n, m, k = z.size(0), S.size(0), S.size(1), 32  # get_k(S.size(0))
-        ctx.prox_lam = prox_lam
-
-        device = "cuda" if S.is_cuda else "cpu"
-        ctx.g = torch.zeros(B, k, device=device)
-        ctx.gnrm = torch.zeros(B, n, device=device)
-        ctx.index = torch.zeros(B, n, dtype=torch.int, device=device)
-        ctx.is_input = torch.zeros(B, n, dtype=torch.int, device=device)
+    def forward(ctx, S, z, is_input, max_iter, eps, prox_lam, k, grad_precision="fp32", dtype=torch.float32,
+                V0=None, delta0=None, workspace=None, instance_perm=False, sparse=False,
+                stats=None, backward_eps=None, backward_max_iter=None):
+        B, n, m = z.size(0), S.size(0), S.size(1)
+        # the sparse kernels stream no rows of S, so they need no padding
+        mp = m if sparse else get_padded_m(m, S.is_cuda)
+        ctx.prox_lam, ctx.m, ctx.mp, ctx.S_dtype = prox_lam, m, mp, S.dtype
+        ctx.grad_math = GRAD_PRECISIONS[grad_precision]
+        ctx.bw_eps = 0.0 if backward_eps is None else backward_eps
+        ctx.bw_max_iter = max_iter if backward_max_iter is None else backward_max_iter
+        ctx.sparse = sparse
+
+        # S and is_input are read-only in the extension and used in place when
+        # their layout already matches
+        copy_S = not sparse and (S.dtype != dtype or mp != m or not S.is_contiguous())
+        copy_is_input = is_input.dtype != torch.int or not is_input.is_contiguous() or is_input.device != S.device
+
         # becuz n includes truth direction(n=1+n'+aux), so here we use n to initialize V directly
-        ctx.V = torch.zeros(B, n, k, device=device).normal_()
-        ctx.W = torch.zeros(B, k, m, device=device)
-        ctx.z = torch.zeros(B, n, device=device)
-        ctx.S = torch.zeros(n, m, device=device)
-        # this stores the iteration number per instance in the batch
-        ctx.niter = torch.zeros(B, dtype=torch.int, device=device)
-        # this store the norm of S array
-        ctx.Snrms = torch.zeros(n, device=device)
+        buffers = [
+            ("g", (B, k), torch.float32),
+            ("gnrm", (B, n), torch.float32),
+            ("index", (B, n), torch.int),
+            ("V", (B, n, k), torch.float32),
+            # transposed for sparse S, see mix_init_sparse
+            ("W", (B, mp, k) if sparse else (B, k, mp), torch.float32),
+            ("z", (B, n), torch.float32),
+            # this stores the iteration number per instance in the batch
+            ("niter", (B,), torch.int),
+            # reference decrease of the stopping rule, set by the first cold sweep
+            ("delta0", (B,), torch.float32),
+            # decrease of the last sweep
+            ("delta", (B,), torch.float32),
+            # this store the norm of S array
+            ("Snrms", (n,), torch.float32),
+        ]
+        if copy_S:
+            buffers.append(("S", (n, mp), dtype))
+        if copy_is_input:
+            buffers.append(("is_input", (B, n), torch.int))
+        ctx.workspace = Workspace() if workspace is None else workspace
+        ctx.arena = ctx.workspace.acquire(buffers, S.device)
+        for name, _, _ in buffers:
+            setattr(ctx, name, getattr(ctx.arena, name))
 
-        ctx.z[:] = z.data
-        ctx.S[:] = S.data
-        ctx.is_input[:] = is_input.data
+        if V0 is None:
+            ctx.V.normal_()
+        else:
+            ctx.V.copy_(V0.detach())
+        if delta0 is None:
+            ctx.delta0.zero_()
+        else:
+            ctx.delta0.copy_(delta0.detach())
+        ctx.z.copy_(z.detach())
+        if copy_S:
+            ctx.S[:, :m] = S.detach()
+            ctx.S[:, m:] = 0
+        else:
+            ctx.S = S.detach()
+        if sparse:
+            # CSR pattern of the nonzeros of S, rebuilt every call as S is trained
+            rows, cols = ctx.S.nonzero(as_tuple=True)
+            ctx.S_idx = (rows, cols)
+            ctx.Srow = torch.zeros(n + 1, dtype=torch.int, device=S.device)
+            ctx.Srow[1:] = torch.bincount(rows, minlength=n).cumsum(0)
+            ctx.Scol = cols.int()
+            ctx.Sval = ctx.S[rows, cols].float()
+        if copy_is_input:
+            ctx.is_input.copy_(is_input)
+        else:
+            ctx.is_input = is_input
 
-        perm = torch.randperm(n - 1, dtype=torch.int, device=device)
+        perm = _solver_perm(B, n, instance_perm, S.device)
 
         satnet_impl = satnet._cuda if S.is_cuda else satnet._cpp
-        satnet_impl.init(perm, is_input, ctx.index, ctx.z, ctx.V)
+        ctx.stats = None if stats is None else stats._shard(B, S.device)
+        # normalizes V, and computes W = V'S (algo2 line3) and S_norm**2 (line6)
+        with _Phase(ctx.stats, "init"):
+            if sparse:
+                satnet_impl.init_sparse(perm, ctx.is_input, ctx.index, ctx.z, ctx.V, ctx.Srow, ctx.Scol, ctx.Sval, ctx.W, ctx.Snrms)
+            else:
+                satnet_impl.init(perm, ctx.is_input, ctx.index, ctx.z, ctx.V, ctx.S, ctx.W, ctx.Snrms, None)
+        with _Phase(ctx.stats, "forward"):
+            if sparse:
+                satnet_impl.forward_sparse(
+                    max_iter, eps, ctx.index, ctx.niter, ctx.delta0, ctx.delta, ctx.Srow, ctx.Scol, ctx.Sval,
+                    ctx.z, ctx.V, ctx.W, ctx.gnrm, ctx.Snrms, ctx.g, None
+                )
+            else:
+                satnet_impl.forward(
+                    max_iter, eps, ctx.index, ctx.niter, ctx.delta0, ctx.delta, ctx.S, ctx.z, ctx.V, ctx.W,
+                    ctx.gnrm, ctx.Snrms, ctx.g, None
+                )
+        if ctx.stats is not None:
+            ctx.stats.niter, ctx.stats.delta0, ctx.stats.delta = ctx.niter.clone(), ctx.delta0.clone(), ctx.delta.clone()
 
-        # algo2 line3 omega initialization, V: bxk, S: nxm, W: kxm
-        for b in range(B):
-            ctx.W[b] = ctx.V[b].t().mm(ctx.S)
-        # precompute S_norm**2 used in line6
-        ctx.Snrms[:] = S.norm(dim=1) ** 2
+        ctx.mark_non_differentiable(ctx.V, ctx.delta0)
+        return ctx.z.clone(), ctx.V, ctx.delta0
 
-        satnet_impl.forward(max_iter, eps, ctx.index, ctx.niter, ctx.S, ctx.z, ctx.V, ctx.W, ctx.gnrm, ctx.Snrms, ctx.g)
+    @staticmethod
+    def backward(ctx, dz, dV, ddelta0):
+        B, n, k = dz.size(0), ctx.V.size(1), ctx.V.size(2)
+        m, mp = ctx.m, ctx.mp
 
-        return ctx.z.clone()
+        # the extension reduces dS = sum_b U_b W_b + V_b Phi_b over the batch;
+        # dS and dz are returned, so they are not taken from the arena
+        ctx.dz = dz.detach().clone(memory_format=torch.contiguous_format)
+        ctx.bw_arena = ctx.workspace.acquire(
+            [
+                ("U", (B, n, k), torch.float32),
+                ("Phi", (B, mp, k) if ctx.sparse else (B, k, mp), torch.float32),
+                # MIX_VALID, or why an instance was dropped from dS
+                ("invalid", (B,), torch.int),
+                # sweeps the solve for U took
+                ("bw_niter", (B,), torch.int),
+            ],
+            ctx.W.device,
+        )
+        ctx.U = ctx.bw_arena.U.zero_()
+        ctx.Phi = ctx.bw_arena.Phi.zero_()
+        ctx.invalid, ctx.bw_niter = ctx.bw_arena.invalid, ctx.bw_arena.bw_niter
+
+        satnet_impl = satnet._cuda if ctx.S.is_cuda else satnet._cpp
+        with _Phase(ctx.stats, "backward"):
+            if ctx.sparse:
+                # the gradient of the nonzeros only, scattered back into a dense dS
+                dSval = torch.empty_like(ctx.Sval)
+                satnet_impl.backward_sparse(
+                    ctx.prox_lam, ctx.bw_max_iter, ctx.bw_eps, ctx.is_input, ctx.index, ctx.niter, ctx.bw_niter,
+                    ctx.invalid, ctx.Srow, ctx.Scol, ctx.Sval,
+                    dSval, ctx.z, ctx.dz, ctx.V, ctx.U, ctx.W, ctx.Phi, ctx.gnrm, ctx.Snrms, ctx.g
+                )
+            else:
+                ctx.dS = torch.empty(n, mp, device=ctx.W.device)
+                satnet_impl.backward(
+                    ctx.prox_lam, ctx.grad_math, ctx.bw_max_iter, ctx.bw_eps, ctx.is_input, ctx.index, ctx.niter,
+                    ctx.bw_niter, ctx.invalid, ctx.S, ctx.dS,
+                    ctx.z, ctx.dz, ctx.V, ctx.U, ctx.W, ctx.Phi, ctx.gnrm, ctx.Snrms, ctx.g
+                )
+        if ctx.stats is not None:
+            ctx.stats.invalid.copy_(ctx.invalid)
+            ctx.stats.bw_niter.copy_(ctx.bw_niter)
+            counts, dev = ctx.stats.owner._invalid, ctx.invalid.device
+            counts[dev] = counts.get(dev, 0) + (ctx.invalid != 0).sum()
+
+        if ctx.sparse:
+            ctx.dS = torch.zeros(n, m, device=ctx.W.device, dtype=ctx.S_dtype)
+            ctx.dS[ctx.S_idx] = dSval.to(ctx.S_dtype)
+        else:
+            ctx.dS = ctx.dS[:, :m].to(ctx.S_dtype)
+
+        return ctx.dS, ctx.dz, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None
+
+
+class _ToDevice(Function):
+    """S.to(device) for one shard of a batch split over GPUs. The backward
+    sends the shard's dS home in grad_dtype (None: as is), as soon as that
+    shard's backward is done, so the transfers overlap the other shards'
+    solves. Autograd sums the shards' dS into S.grad in FP32."""
+
+    @staticmethod
+    def forward(ctx, S, device, grad_dtype):
+        ctx.src, ctx.grad_dtype = S.device, grad_dtype
+        return S.to(device)
 
     @staticmethod
-    def backward(ctx, dz):
-        B, n, m, k = dz.size(0), ctx.S.size(0), ctx.S.size(1), 32  # get_k(ctx.S.size(0))
+    def backward(ctx, dS):
+        dtype = dS.dtype
+        if ctx.grad_dtype is not None:
+            dS = dS.to(ctx.grad_dtype)
+        return dS.to(ctx.src, non_blocking=True).to(dtype), None, None
 
-        device = "cuda" if ctx.S.is_cuda else "cpu"
-        ctx.dS = torch.zeros(B, n, m, device=device)
-        ctx.U = torch.zeros(B, n, k, device=device)
-        ctx.Phi = torch.zeros(B, k, m, device=device)
-        ctx.dz = torch.zeros(B, n, device=device)
 
-        ctx.dz[:] = dz.data
+# scratch floats of mix_solve's V and W; batches needing more run in chunks
+SOLVE_SCRATCH_FLOATS = 1 << 26
 
-        satnet_impl = satnet._cuda if ctx.S.is_cuda else satnet._cpp
-        satnet_impl.backward(
-            ctx.prox_lam,
-            ctx.is_input,
-            ctx.index,
-            ctx.niter,
-            ctx.S,
-            ctx.dS,
-            ctx.z,
-            ctx.dz,
-            ctx.V,
-            ctx.U,
-            ctx.W,
-            ctx.Phi,
-            ctx.gnrm,
-            ctx.Snrms,
-            ctx.g,
+
+def _solver_S(S, dtype):
+    # S in the storage dtype, contiguous and padded as the extension wants it
+    n, m = S.size(0), S.size(1)
+    mp = get_padded_m(m, S.is_cuda)
+    S = S.detach()
+    if S.dtype != dtype or mp != m or not S.is_contiguous():
+        Sp = torch.zeros(n, mp, dtype=dtype, device=S.device)
+        Sp[:, :m] = S
+        S = Sp
+    return S
+
+
+def _solver_perm(B, n, instance_perm, device, generator=None):
+    # order of the coordinate updates, drawn on the device
+    if instance_perm:
+        return torch.rand(B, n - 1, device=device, generator=generator).argsort(dim=1).int()
+    return torch.randperm(n - 1, dtype=torch.int, device=device, generator=generator)
+
+
+def mix_solve(S, z, is_input, max_iter, eps, k, dtype=torch.float32, instance_perm=False):
+    """The forward of MixingFunc for inference: returns z only, and keeps no
+    state for a backward pass or a warm start. The extension solves in
+    chunks of the batch, so the scratch stays within SOLVE_SCRATCH_FLOATS."""
+    B, n = z.size(0), S.size(0)
+    S = _solver_S(S, dtype)
+    mp = S.size(1)
+    # solved in place
+    z = z.detach().to(torch.float32).clone(memory_format=torch.contiguous_format)
+    is_input = is_input.to(device=S.device, dtype=torch.int).contiguous()
+    perm = _solver_perm(B, n, instance_perm, S.device)
+
+    chunk = max(1, SOLVE_SCRATCH_FLOATS // (k * (n + mp)))
+    satnet_impl = satnet._cuda if S.is_cuda else satnet._cpp
+    satnet_impl.solve(max_iter, eps, chunk, k, perm, is_input, z, S)
+    return z
+
+
+def solve_grouped(layers, zs, is_inputs):
+    """Inference of several SATNet layers at once, e.g. an ensemble of models
+    with different S on the same batch: returns the z of layers[p] for zs[p]
+    and is_inputs[p], as layers[p](zs[p], is_inputs[p]) would in eval mode
+    without grad. The problems may differ in n, m, k and batch size. They
+    share one launch (CUDA) or one parallel region (CPU), which fills the
+    machine with several small solves at a time. The layers must be on one
+    device, on CUDA with one dtype."""
+    if not (len(layers) == len(zs) == len(is_inputs)):
+        raise ValueError("solve_grouped needs one z and is_input per layer")
+    if not layers:
+        return []
+    device = layers[0].S.device
+    if any(l.S.device != device for l in layers):
+        raise ValueError("solve_grouped needs all layers on one device")
+    if device.type == "cuda" and any(l.dtype != layers[0].dtype for l in layers):
+        raise ValueError("solve_grouped needs one dtype for all layers on CUDA")
+
+    perms, zs_in, is_inputs_in, Ss = [], [], [], []
+    for layer, z, is_input in zip(layers, zs, is_inputs):
+        B, n = z.size(0), layer.S.size(0)
+        is_input = insert_constants(is_input.data, pre=1, n_pre=1, app=0, n_app=layer.aux)
+        # solved in place
+        z = torch.cat([z.new_ones(B, 1), z.detach(), z.new_zeros(B, layer.aux)], dim=1)
+        zs_in.append(z.to(device=device, dtype=torch.float32).contiguous())
+        is_inputs_in.append(is_input.to(device=device, dtype=torch.int).contiguous())
+        perms.append(_solver_perm(B, n, layer.instance_perm, device))
+        Ss.append(_solver_S(layer.S, layer.dtype))
+    satnet_impl = satnet._cuda if device.type == "cuda" else satnet._cpp
+    satnet_impl.solve_grouped(
+        [l.max_iter for l in layers], [l.eps for l in layers], [l.k for l in layers], perms, is_inputs_in, zs_in, Ss
+    )
+    return [z[:, 1 : l.S.size(0) - l.aux] for l, z in zip(layers, zs_in)]
+
+
+class SolverState(object):
+    """A solve of a batch to continue from, with mix_resume (new inputs) or
+    mix_continue (more sweeps): the padded S, the z and is_input (truth and
+    aux variables included) it was solved for, and the solver's V, W = V'S,
+    gnrm, index, Snrms, delta0 and delta, niter counting the sweeps since
+    the inputs last changed, and the RNG seed of the cold start. It belongs to the
+    version of S it was solved with; a resume with any other S starts cold.
+
+    save and load keep it in a file that the extension writes and reads
+    directly, e.g. to checkpoint a long solve on a preemptible node.
+    """
+
+    # the arrays of a state file, in this order
+    ARRAYS = ("z", "is_input", "V", "W", "gnrm", "index", "niter", "Snrms", "delta0", "delta")
+
+    def __init__(self, key, S, seed, **arrays):
+        self.key, self.S, self.seed = key, S, seed
+        for name in self.ARRAYS:
+            setattr(self, name, arrays[name])
+
+    def save(self, path):
+        satnet._cpp.state_save(path, self.seed, [getattr(self, a).cpu().contiguous() for a in self.ARRAYS])
+
+    @classmethod
+    def load(cls, path, S, dtype=torch.float32):
+        """The state saved at path, for the S (n x m, unpadded) and storage
+        dtype it was solved with, on the device of S."""
+        seed, arrays = satnet._cpp.state_load(path)
+        if len(arrays) != len(cls.ARRAYS):
+            raise ValueError("expected " + str(len(cls.ARRAYS)) + " arrays in " + path + ". Now " + str(len(arrays)))
+        arrays = {a: t.to(S.device) for a, t in zip(cls.ARRAYS, arrays)}
+        Sp = _solver_S(S, dtype)
+        B, n, k = arrays["V"].shape
+        if n != Sp.size(0) or tuple(arrays["W"].shape) != (B, k, Sp.size(1)):
+            raise ValueError("the state in " + path + " is for another S. Now S of shape " + str(tuple(S.shape)))
+        return cls(_solver_key(S, dtype, B, k), Sp, seed, **arrays)
+
+
+def _solver_key(S, dtype, B, k):
+    # the optimizer updates S in place, which bumps its version
+    return (S.data_ptr(), S._version, S.device, dtype, tuple(S.shape), B, k)
+
+
+def mix_resume(S, z, is_input, max_iter, eps, k, dtype=torch.float32, instance_perm=False, state=None):
+    """The forward of MixingFunc for interactive inference, where a query
+    differs from the previous one in a few inputs. Returns (z, state); pass
+    state back with the next query of the same batch. Only the rows of V of
+    the inputs that changed are set again (W follows by rank-1 updates), and
+    the solve continues from the previous solution instead of doing mix_init,
+    the W = V'S rebuild and a cold solve. state is updated in place. No
+    backward pass is possible."""
+    B, n = z.size(0), S.size(0)
+    key = _solver_key(S, dtype, B, k)
+    device = S.device
+    z = z.detach().to(device=device, dtype=torch.float32).clone(memory_format=torch.contiguous_format)
+    is_input = is_input.to(device=device, dtype=torch.int).contiguous()
+
+    satnet_impl = satnet._cuda if S.is_cuda else satnet._cpp
+    if state is None or state.key != key:
+        # drawn from a seed of its own, so that a saved state records how it started
+        seed = int(torch.randint(2 ** 62, (1,)))
+        gen = torch.Generator(device=device).manual_seed(seed)
+        Sp = _solver_S(S, dtype)
+        state = SolverState(
+            key, Sp, seed, z=z, is_input=is_input,
+            V=torch.randn(B, n, k, device=device, generator=gen),
+            W=torch.empty(B, k, Sp.size(1), device=device),
+            gnrm=torch.empty(B, n, device=device),
+            index=torch.empty(B, n, dtype=torch.int, device=device),
+            niter=torch.zeros(B, dtype=torch.int, device=device),
+            Snrms=torch.empty(n, device=device),
+            delta0=torch.zeros(B, device=device),
+            delta=torch.empty(B, device=device),
         )
+        perm = _solver_perm(B, n, instance_perm, device, gen)
+        satnet_impl.init(perm, is_input, state.index, z, state.V, Sp, state.W, state.Snrms, None)
+    else:
+        # a new input value counts only where the variable is, and was, an input
+        changed = (is_input != state.is_input) | ((is_input != 0) & (z != state.z))
+        perm = _solver_perm(B, n, instance_perm, device)
+        satnet_impl.update(perm, changed.int(), is_input, state.index, z, state.V, state.S, state.W)
+        state.z, state.is_input = z, is_input
+        state.niter.zero_()
+    return mix_continue(state, max_iter, eps), state
 
-        ctx.dS = ctx.dS.sum(dim=0)
 
-        return ctx.dS, ctx.dz, None, None, None, None
+def mix_continue(state, max_iter, eps):
+    """Up to max_iter more sweeps of the solve in state, e.g. the rest of an
+    interrupted one, in the variable order it started with. eps stays relative
+    to the first sweep of the cold solve (state.delta0), so a solve that
+    converged stops after one sweep. Returns z, and updates state in place."""
+    B, n, k = state.V.shape
+    niter = torch.empty(B, dtype=torch.int, device=state.V.device)
+    g = torch.empty(B, k, device=state.V.device)
+    satnet_impl = satnet._cuda if state.V.is_cuda else satnet._cpp
+    satnet_impl.forward(
+        max_iter, eps, state.index, niter, state.delta0, state.delta, state.S, state.z, state.V, state.W,
+        state.gnrm, state.Snrms, g, None
+    )
+    state.niter += niter
+    return state.z.clone()
 
 
 def insert_constants(x, pre, n_pre, app, n_app):
@@ -132,12 +593,73 @@ class SATNet(nn.Module):
             Default: 1e-2
         weight_normalize: Set true to perform normlization for init weights.
             Default: True
+        k: Rank of the SDP relaxation, i.e. the length of each variable's
+            vector. The kernels are specialized for k in {4, 8, 16, 32, 64};
+            `None` picks get_k(n + 1 + aux), about sqrt(2n).
+            Default: 32
+        grad_precision: Math mode of the dS GEMM at the end of the CUDA
+            backward pass: "fp32", "tf32" or "fp16" (tensor cores, FP32
+            accumulation). The CPU backend always uses FP32.
+            Default: "fp32"
+        dtype: Storage format of the clause matrix inside the solver:
+            torch.float32, torch.float16 or torch.bfloat16. The 16-bit
+            formats halve the traffic of the rows of S streamed through the
+            mixing kernels. W, the gradients and all arithmetic stay FP32,
+            and the parameter S itself keeps its own dtype.
+            Default: torch.float32
+        warm_start: Set true to cache the converged solution of every sample
+            passed with `ids` and start its next solve from there, which cuts
+            the iterations on repeated or near-duplicate inputs (validation
+            every epoch, inference). The cache holds an `(n+1+aux, k)` tensor per
+            sample on the device of S; clear it with reset_warm_start().
+            The backward pass runs as many sweeps as the forward pass unless
+            backward_eps is set, so a warm-started training step (few forward
+            sweeps) gets a coarser gradient without it.
+            Default: False
+        backward_eps: The stopping threshold of the sweeps solving the
+            backward linear system for U: they stop when |U_new - U_old|^2 of
+            a sweep is at most backward_eps times that of the first one.
+            None runs as many sweeps as the forward pass took.
+            Default: None
+        backward_max_iter: Maximum number of backward sweeps when
+            backward_eps is set; None uses max_iter.
+            Default: None
+        instance_perm: Set true to draw a separate random order of the
+            coordinate updates for every sample instead of one per batch.
+            Default: False
+        sparse: Set true to run the solver on the nonzeros of S only, stored
+            as CSR, so that every sweep and the gradient cost O(nnz*k)
+            instead of O(n*m*k). Worth it for S below ~10% density, e.g.
+            after prune_(). The pattern is taken from S on every call, and
+            the gradient is restricted to it, so zero entries stay zero under
+            training. Requires dtype torch.float32, and is not supported by
+            compile_graph (the pattern is sized on the host).
+            Default: False
+        devices: CUDA devices to split every batch over, e.g. [0, 1, 2, 3].
+            Each gets a contiguous shard of the batch and a copy of S, and
+            the shards are solved concurrently. Every shard reduces its dS
+            over its own samples, so the transfer back to the device of S is
+            n x m per device; autograd sums them into S.grad. z, is_input
+            and the output stay on the device of S. None or a single device
+            solves on the device of S.
+            Default: None
+        grad_reduce_dtype: Dtype the shards' dS is sent back to the device
+            of S in, e.g. torch.bfloat16 to halve the transfer; it is summed
+            in FP32 there. None keeps FP32.
+            Default: None
+        stats: Set true to record the convergence and timing of every call
+            into the SolverStats at `self.stats`, e.g. to tune max_iter and
+            eps from production telemetry. Recording layers always run
+            through MixingFunc, also under no_grad.
+            Default: False
 
-    Inputs: (z, is_input)
+    Inputs: (z, is_input, ids=None)
         **z** of shape `(batch, n)`:
             Float tensor containing the probabilities (must be in [0,1]).
         **is_input** of shape `(batch, n)`:
             Int tensor indicating which **z** is a input.
+        **ids** of length `batch`, optional:
+            Sample ids keying the warm-start cache.
 
     Outputs: z
         **z** of shape `(batch, n)`:
@@ -155,7 +677,9 @@ class SATNet(nn.Module):
         >>> pred = sat(z, is_input)
     """
 
-    def __init__(self, n, m, aux=0, max_iter=40, eps=1e-4, prox_lam=1e-2, weight_normalize=True):
+    def __init__(self, n, m, aux=0, max_iter=40, eps=1e-4, prox_lam=1e-2, weight_normalize=True, k=32,
+                 grad_precision="fp32", dtype=torch.float32, warm_start=False, instance_perm=False, sparse=False,
+                 devices=None, grad_reduce_dtype=None, stats=False, backward_eps=None, backward_max_iter=None):
         super(SATNet, self).__init__()
 
         S_t = torch.FloatTensor(n + 1 + aux, m)  # extra 1 for truth vector
@@ -166,13 +690,128 @@ class SATNet(nn.Module):
         self.S = nn.Parameter(S_t)
         self.aux = aux
         self.max_iter, self.eps, self.prox_lam = max_iter, eps, prox_lam
+        self.backward_eps, self.backward_max_iter = backward_eps, backward_max_iter
+        self.k = get_k(n + 1 + aux) if k is None else k
+        if self.k < 2:
+            raise ValueError("k is required to be at least 2 (truth and input directions). Now " + str(self.k))
+        if grad_precision not in GRAD_PRECISIONS:
+            raise ValueError("grad_precision must be one of " + str(list(GRAD_PRECISIONS)) + ". Now " + str(grad_precision))
+        self.grad_precision = grad_precision
+        if dtype not in DTYPES:
+            raise ValueError("dtype must be one of " + str(DTYPES) + ". Now " + str(dtype))
+        self.dtype = dtype
+        self.warm_start = warm_start
+        self.warm_cache = {}
+        self.workspace = Workspace()
+        self.instance_perm = instance_perm
+        if sparse and dtype != torch.float32:
+            raise ValueError("sparse requires dtype torch.float32. Now " + str(dtype))
+        self.sparse = sparse
+        self.devices = None
+        if devices is not None and len(devices) > 1:
+            self.devices = []
+            for d in devices:
+                d = torch.device("cuda", d) if isinstance(d, int) else torch.device(d)
+                if d.type != "cuda":
+                    raise ValueError("devices must be CUDA devices. Now " + str(d))
+                self.devices.append(torch.device("cuda", torch.cuda.current_device()) if d.index is None else d)
+        if grad_reduce_dtype not in (None,) + DTYPES:
+            raise ValueError("grad_reduce_dtype must be None or one of " + str(DTYPES) + ". Now " + str(grad_reduce_dtype))
+        self.grad_reduce_dtype = grad_reduce_dtype
+        self.stats = SolverStats() if stats else None
+
+    def reset_warm_start(self):
+        """Drop every cached solution, e.g. after S changed a lot."""
+        self.warm_cache.clear()
+
+    def prune_(self, threshold):
+        """Zero the entries of S below threshold in magnitude, in place. With
+        sparse=True those entries then drop out of the solver for good."""
+        with torch.no_grad():
+            self.S[self.S.abs() < threshold] = 0
+
+    def _warm_start_init(self, ids, B, device):
+        hits = [b for b, i in enumerate(ids) if i in self.warm_cache]
+        if not hits:
+            return None, None
+        n = self.S.size(0)
+        V0 = torch.zeros(B, n, self.k, device=device).normal_()
+        delta0 = torch.zeros(B, device=device)
+        V0[hits] = torch.stack([self.warm_cache[ids[b]][0] for b in hits])
+        delta0[hits] = torch.stack([self.warm_cache[ids[b]][1] for b in hits])
+        return V0, delta0
+
+    def compile_graph(self, B, z_requires_grad=False, num_warmup_iters=3):
+        """Capture forward and backward for batches of exactly B samples.
+
+        Returns a callable with the signature of forward(z, is_input) that
+        replays CUDA graphs of the whole layer: every kernel launch, the
+        buffer setup, and the device-side RNG for V and the variable order.
+        This removes the launch overhead that dominates small puzzles. The
+        graphs are fixed to the batch size, the device, and whether z requires
+        grad (set z_requires_grad for a layer fed by a trained network), and to
+        the layer's current train/eval mode. S keeps being read from the
+        parameter in place, so replays see the optimizer steps. The layer
+        itself stays uncaptured for other batch sizes.
 
-    def forward(self, z, is_input):
+        Not supported for layers with warm_start, devices, sparse or stats:
+        each of them runs host-side work per call that a replay would skip.
+        """
+        if not self.S.is_cuda:
+            raise ValueError("compile_graph requires the SATNet layer on a CUDA device")
+        if self.warm_start:
+            raise ValueError("compile_graph does not support warm_start, its cache lookup runs on the host")
+        if self.devices:
+            raise ValueError("compile_graph does not support devices, capture one layer per device instead")
+        if self.sparse:
+            raise ValueError("compile_graph does not support sparse, the CSR pattern of S is sized on the host")
+        if self.stats is not None:
+            raise ValueError("compile_graph does not support stats, its timing events and counters live on the host")
+        n = self.S.size(0) - 1 - self.aux
+        z = torch.rand(B, n, device=self.S.device, requires_grad=z_requires_grad)
+        is_input = torch.zeros(B, n, dtype=torch.int, device=self.S.device)
+        is_input[:, : n // 2] = 1
+        torch.cuda.make_graphed_callables(self, (z, is_input), num_warmup_iters=num_warmup_iters)
+        # make_graphed_callables patches self.forward; hand that out instead
+        graphed = self.forward
+        del self.forward
+        return graphed
+
+    def _mix(self, S, z, is_input, V0, delta0):
+        # without autograd and a warm start nothing but z is needed
+        grad = torch.is_grad_enabled() and (S.requires_grad or z.requires_grad)
+        if not grad and not self.warm_start and not self.sparse and self.stats is None:
+            return mix_solve(S, z, is_input, self.max_iter, self.eps, self.k, self.dtype, self.instance_perm), None, None
+        return MixingFunc.apply(
+            S, z, is_input, self.max_iter, self.eps, self.prox_lam, self.k, self.grad_precision, self.dtype,
+            V0, delta0, self.workspace, self.instance_perm, self.sparse, self.stats,
+            self.backward_eps, self.backward_max_iter
+        )
+
+    def _forward_sharded(self, z, is_input, V0, delta0):
+        # the kernels are asynchronous, so the shards run concurrently once
+        # all of them are launched
+        home, D, B = self.S.device, len(self.devices), z.size(0)
+        outs = []
+        for d, dev in enumerate(self.devices):
+            lo, hi = B * d // D, B * (d + 1) // D
+            if lo == hi:
+                continue
+            S = self.S if dev == home else _ToDevice.apply(self.S, dev, self.grad_reduce_dtype)
+            with torch.cuda.device(dev):
+                outs.append(self._mix(
+                    S, z[lo:hi].to(dev), is_input[lo:hi].to(dev),
+                    None if V0 is None else V0[lo:hi].to(dev),
+                    None if delta0 is None else delta0[lo:hi].to(dev),
+                ))
+        z = torch.cat([o[0].to(home) for o in outs])
+        if not self.warm_start:
+            return z, None, None
+        return z, torch.cat([o[1].to(home) for o in outs]), torch.cat([o[2].to(home) for o in outs])
+
+    def forward(self, z, is_input, ids=None):
         B = z.size(0)
         device = "cuda" if self.S.is_cuda else "cpu"
-        m = self.S.shape[1]
-        if device == "cpu" and m % 4 != 0:
-            raise ValueError("m is required to be a multiple of 4 on CPU for SSE acceleration. Now " + str(m))
         # here we preappend the truth direction and set as input (1 - no need to calculate in forward pass)
         # we also append aux variables and set as output (0)
         is_input = insert_constants(is_input.data, pre=1, n_pre=1, app=0, n_app=self.aux)
@@ -181,6 +820,211 @@ class SATNet(nn.Module):
             [torch.ones(z.size(0), 1, device=device), z, torch.zeros(z.size(0), self.aux, device=device)], dim=1
         )
 
-        z = MixingFunc.apply(self.S, z, is_input, self.max_iter, self.eps, self.prox_lam)
+        if self.stats is not None:
+            self.stats.begin()
+        V0 = delta0 = None
+        if self.warm_start and ids is not None:
+            ids = [int(i) for i in ids]
+            if len(ids) != B:
+                raise ValueError("ids must hold one id per sample. Now " + str(len(ids)) + " for a batch of " + str(B))
+            V0, delta0 = self._warm_start_init(ids, B, device)
+
+        if self.devices and self.S.is_cuda:
+            z, V, delta0 = self._forward_sharded(z, is_input, V0, delta0)
+        else:
+            z, V, delta0 = self._mix(self.S, z, is_input, V0, delta0)
+
+        if self.warm_start and ids is not None:
+            for b, i in enumerate(ids):
+                self.warm_cache[i] = (V[b].clone(), delta0[b].clone())
         # we return the variable w/o truth vector and aux
         return z[:, 1 : self.S.size(0) - self.aux]
+
+    def solve_incremental(self, z, is_input, state=None, max_iter=None):
+        """Inference for a stream of queries of one batch that differ in a few
+        inputs, e.g. one more Sudoku cell filled in: returns (z, state), and
+        the next call with that state only redoes the inputs that changed and
+        continues the solve from the previous solution, see mix_resume. A
+        state of an earlier S (after an optimizer step) is dropped. Runs
+        without autograd, on the device of S. max_iter (default: the layer's)
+        caps the sweeps of this call, see continue_solve for the rest."""
+        B = z.size(0)
+        max_iter = self.max_iter if max_iter is None else max_iter
+        with torch.no_grad():
+            is_input = insert_constants(is_input.data, pre=1, n_pre=1, app=0, n_app=self.aux)
+            z = torch.cat(
+                [z.new_ones(B, 1), z, z.new_zeros(B, self.aux)], dim=1
+            )
+            z, state = mix_resume(
+                self.S, z, is_input, max_iter, self.eps, self.k, self.dtype, self.instance_perm, state
+            )
+        return z[:, 1 : self.S.size(0) - self.aux], state
+
+    def continue_solve(self, state, max_iter=None):
+        """Up to max_iter (default: the layer's) more sweeps of the solve in
+        state, e.g. one that solve_incremental was capped on or that was
+        loaded with load_state. Returns z as solve_incremental does."""
+        max_iter = self.max_iter if max_iter is None else max_iter
+        with torch.no_grad():
+            z = mix_continue(state, max_iter, self.eps)
+        return z[:, 1 : self.S.size(0) - self.aux]
+
+    def load_state(self, path):
+        """A SolverState saved with SolverState.save for this layer's S."""
+        return SolverState.load(path, self.S, self.dtype)
+
+
+class _Ticket(object):
+    pass
+
+
+class _EngineStream(object):
+    pass
+
+
+class SATNetEngine(object):
+    """Streaming inference with a trained SATNet layer on CUDA.
+
+    S is converted to the solver's format once and stays resident on the
+    device. submit() stages a batch in pinned host memory and queues the
+    host-to-device copy, init, forward and the copy of z back on one of
+    `num_streams` CUDA streams, and returns at once; result() waits for that
+    batch only. With two or more streams the copies of one batch overlap the
+    solve of another. S (and for 16-bit dtypes its FP32 copy for init) is
+    prepared once, and every stream owns its buffers, sized for `max_batch`,
+    including the variable order and the forward kernel's work queue, so a
+    request allocates no solver buffers and keeps nothing for a backward
+    pass.
+    A stream holds one batch in flight: submitting more than num_streams
+    batches before collecting them waits for the oldest.
+
+    The engine reads the layer's S when it is created; build a new one after
+    training further.
+
+    Args:
+        layer: a SATNet on a CUDA device.
+        max_batch: largest batch passed to submit.
+        num_streams: batches in flight.
+
+    Examples:
+        >>> engine = satnet.SATNetEngine(sat, max_batch=256)
+        >>> tickets = [engine.submit(z, is_input) for z, is_input in requests]
+        >>> preds = [engine.result(t) for t in tickets]
+    """
+
+    def __init__(self, layer, max_batch, num_streams=2):
+        if not layer.S.is_cuda:
+            raise ValueError("SATNetEngine requires the SATNet layer on a CUDA device")
+        if num_streams < 1:
+            raise ValueError("num_streams must be at least 1. Now " + str(num_streams))
+        self.layer, self.max_batch = layer, max_batch
+        self.device = layer.S.device
+        N, m, k = layer.S.size(0), layer.S.size(1), layer.k
+        self.n = N - 1 - layer.aux
+
+        with torch.cuda.device(self.device):
+            S = layer.S.detach()
+            if layer.sparse:
+                rows, cols = S.nonzero(as_tuple=True)
+                self.Srow = torch.zeros(N + 1, dtype=torch.int, device=self.device)
+                self.Srow[1:] = torch.bincount(rows, minlength=N).cumsum(0)
+                self.Scol, self.Sval = cols.int(), S[rows, cols].float()
+            else:
+                self.S = S.to(layer.dtype).contiguous()
+            # the FP32 copy of a 16-bit S that init's W = V'S GEMM reads
+            self.Sf = None if layer.sparse or layer.dtype == torch.float32 else self.S.float()
+
+            self.streams = []
+            for _ in range(num_streams):
+                s = _EngineStream()
+                s.stream = torch.cuda.Stream(self.device)
+                s.done = torch.cuda.Event()
+                s.ticket = None
+                s.z_host = torch.empty(max_batch, self.n).pin_memory()
+                s.is_input_host = torch.empty(max_batch, self.n, dtype=torch.int).pin_memory()
+                s.z_out = torch.empty(max_batch, self.n).pin_memory()
+                # truth direction and aux variables set once, see SATNet.forward
+                s.z = torch.zeros(max_batch, N, device=self.device)
+                s.z[:, 0] = 1
+                s.is_input = torch.zeros(max_batch, N, dtype=torch.int, device=self.device)
+                s.is_input[:, 0] = 1
+                s.V = torch.empty(max_batch, N, k, device=self.device)
+                s.W = torch.empty((max_batch, m, k) if layer.sparse else (max_batch, k, m), device=self.device)
+                s.index = torch.empty(max_batch, N, dtype=torch.int, device=self.device)
+                s.niter = torch.empty(max_batch, dtype=torch.int, device=self.device)
+                s.delta0 = torch.empty(max_batch, device=self.device)
+                s.delta = torch.empty(max_batch, device=self.device)
+                s.gnrm = torch.empty(max_batch, N, device=self.device)
+                s.g = torch.empty(max_batch, k, device=self.device)
+                s.Snrms = torch.empty(N, device=self.device)
+                # the variable order, drawn into place, and the counter of the
+                # forward kernel's work queue
+                if layer.instance_perm:
+                    s.perm_keys = torch.empty(max_batch, N - 1, device=self.device)
+                    s.perm_sorted = torch.empty(max_batch, N - 1, device=self.device)
+                    s.perm_idx = torch.empty(max_batch, N - 1, dtype=torch.long, device=self.device)
+                    s.perm = torch.empty(max_batch, N - 1, dtype=torch.int, device=self.device)
+                else:
+                    s.perm = torch.empty(N - 1, dtype=torch.int, device=self.device)
+                s.queue = torch.zeros(1, dtype=torch.int, device=self.device)
+                # the buffers above were filled on the current stream
+                s.stream.wait_stream(torch.cuda.current_stream(self.device))
+                self.streams.append(s)
+        self.next = 0
+
+    def submit(self, z, is_input):
+        """Queue the batch z, is_input of shape `(batch, n)` (host or
+        device tensors) and return a ticket for result()."""
+        B = z.size(0)
+        if B > self.max_batch:
+            raise ValueError("batch of " + str(B) + " exceeds max_batch " + str(self.max_batch))
+        s = self.streams[self.next]
+        self.next = (self.next + 1) % len(self.streams)
+        if s.ticket is not None:
+            self._collect(s)
+
+        layer, n, N = self.layer, self.n, self.n + 1 + self.layer.aux
+        s.z_host[:B].copy_(z)
+        s.is_input_host[:B].copy_(is_input)
+        with torch.cuda.device(self.device), torch.cuda.stream(s.stream):
+            z, is_input = s.z[:B], s.is_input[:B]
+            z[:, 1 : n + 1].copy_(s.z_host[:B], non_blocking=True)
+            is_input[:, 1 : n + 1].copy_(s.is_input_host[:B], non_blocking=True)
+            V, W, index, niter = s.V[:B].normal_(), s.W[:B], s.index[:B], s.niter[:B]
+            delta0, delta, gnrm, g = s.delta0[:B].zero_(), s.delta[:B], s.gnrm[:B], s.g[:B]
+            if layer.instance_perm:
+                torch.sort(s.perm_keys[:B].uniform_(), dim=1, out=(s.perm_sorted[:B], s.perm_idx[:B]))
+                perm = s.perm[:B].copy_(s.perm_idx[:B])
+            else:
+                perm = torch.randperm(N - 1, out=s.perm)
+
+            if layer.sparse:
+                satnet._cuda.init_sparse(perm, is_input, index, z, V, self.Srow, self.Scol, self.Sval, W, s.Snrms)
+                satnet._cuda.forward_sparse(
+                    layer.max_iter, layer.eps, index, niter, delta0, delta, self.Srow, self.Scol, self.Sval,
+                    z, V, W, gnrm, s.Snrms, g, s.queue
+                )
+            else:
+                satnet._cuda.init(perm, is_input, index, z, V, self.S, W, s.Snrms, self.Sf)
+                satnet._cuda.forward(
+                    layer.max_iter, layer.eps, index, niter, delta0, delta, self.S, z, V, W, gnrm, s.Snrms, g, s.queue
+                )
+
+            s.z_out[:B].copy_(z[:, 1 : n + 1], non_blocking=True)
+            s.done.record()
+
+        ticket = _Ticket()
+        ticket.stream, ticket.B, ticket.z = s, B, None
+        s.ticket = ticket
+        return ticket
+
+    def result(self, ticket):
+        """Wait for a submitted batch and return its z, `(batch, n)` on the host."""
+        if ticket.z is None:
+            self._collect(ticket.stream)
+        return ticket.z
+
+    def _collect(self, s):
+        s.done.synchronize()
+        s.ticket.z = s.z_out[: s.ticket.B].clone()
+        s.ticket = None
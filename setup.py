@@ -1,3 +1,5 @@
+import platform
+
 import torch.cuda
 
 from setuptools import setup
@@ -14,6 +16,10 @@ gencode = [
         '-gencode=arch=compute_86,code=sm_86',
 ]
 
+# the SSE4.1 kernels are the x86 baseline, see satnet_simd.cpp; other
+# architectures need no flag
+cpu_simd_args = ['-msse4.1'] if platform.machine().lower() in ('x86_64', 'amd64', 'i386', 'i686') else []
+
 ext_modules = [
     CppExtension(
         name = 'satnet._cpp',
@@ -21,8 +27,9 @@ ext_modules = [
         sources = [
             'src/satnet.cpp',
             'src/satnet_cpu.cpp',
+            'src/satnet_simd.cpp',
         ],
-        extra_compile_args = ['-fopenmp', '-msse4.1', '-Wall', '-g']
+        extra_compile_args = ['-fopenmp', '-Wall', '-g'] + cpu_simd_args
     )
 ]
 
@@ -34,6 +41,7 @@ if torch.cuda.is_available() and CUDA_HOME is not None:
             'src/satnet.cpp',
             'src/satnet_cuda.cu',
         ],
+        libraries = ['cublas'],
         extra_compile_args = {
             'cxx': ['-DMIX_USE_GPU', '-g'],
             'nvcc': ['-g', '-restrict', '-maxrregcount', '32', '-lineinfo', '-Xptxas=-v']
@@ -1,5 +1,6 @@
 #ifdef MIX_USE_GPU
     #include <ATen/cuda/CUDAContext.h>
+    #include <c10/cuda/CUDAGuard.h>
 #endif
 #include <torch/extension.h>
 
@@ -8,7 +9,10 @@
 	#define _MIX_DEV_STR "cuda"
 	#define _MIX_CUDA_DECL , cudaStream_t stream
 	#define _MIX_CUDA_ARG , stream
-	#define _MIX_CUDA_HEAD cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+	// launches on the device of the tensor t (one shard of a batch split over
+	// GPUs, see SATNet's devices), whatever the current device of the caller
+	#define _MIX_CUDA_HEAD(t) const at::cuda::OptionalCUDAGuard device_guard(device_of(t)); \
+                              cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 	#define _MIX_CUDA_TAIL  AT_CUDA_CHECK(cudaGetLastError()); 
                             //AT_CUDA_CHECK(cudaStreamSynchronize(stream));
 #else
@@ -16,7 +20,7 @@
 	#define _MIX_DEV_STR "cpu"
 	#define _MIX_CUDA_DECL
 	#define _MIX_CUDA_ARG
-	#define _MIX_CUDA_HEAD
+	#define _MIX_CUDA_HEAD(t)
 	#define _MIX_CUDA_TAIL
 #endif
 
@@ -26,78 +30,496 @@
 #define _MIX_FUNC(name) _MIX_EVAL(name, DEVICE_NAME)
 
 #include "satnet.h"
+#ifndef MIX_USE_GPU
+    #include "satnet_simd.h"
+#endif
 
 using Tensor=torch::Tensor;
 float *fptr(Tensor& a) { return a.data_ptr<float>(); }
 int   *iptr(Tensor& a) { return a.data_ptr<int>(); }
+void  *vptr(Tensor& a) { return a.data_ptr(); }
+
+// storage format of S: float32, float16 or bfloat16
+int mix_dtype(Tensor& S)
+{
+    switch (S.scalar_type()) {
+        case at::kFloat:    return MIX_FP32;
+        case at::kHalf:     return MIX_FP16;
+        case at::kBFloat16: return MIX_BF16;
+        default: TORCH_CHECK(false, "SATNet: unsupported dtype ", S.scalar_type());
+    }
+    return MIX_FP32;
+}
 
-void _MIX_FUNC(mix_init_launcher)    (mix_t mix, int32_t *perm             _MIX_CUDA_DECL);
-void _MIX_FUNC(mix_forward_launcher) (mix_t mix, int max_iter, float eps   _MIX_CUDA_DECL);
-void _MIX_FUNC(mix_backward_launcher)(mix_t mix, float prox_lam            _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_init_launcher)    (mix_t mix, int32_t *perm, int perm_stride _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_update_launcher)  (mix_t mix, int32_t *perm, int perm_stride, const int32_t *changed _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_forward_launcher) (mix_t mix, int max_iter, float eps        _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_backward_launcher)(mix_t mix, float prox_lam, int max_iter, float eps, int math _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_solve_grouped_launcher)(mix_group_t *group, int ngroup _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_init_sparse_launcher)    (mix_t mix, int32_t *perm, int perm_stride _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_forward_sparse_launcher) (mix_t mix, int max_iter, float eps        _MIX_CUDA_DECL);
+void _MIX_FUNC(mix_backward_sparse_launcher)(mix_t mix, float prox_lam, int max_iter, float eps _MIX_CUDA_DECL);
 
+// Sf, optional: S widened to FP32 (n x m) once by the caller, e.g. a
+// resident S of SATNetEngine, which the CUDA init of a 16-bit S then reads
+// instead of widening S into a buffer of its own on every call.
 void mix_init(Tensor perm,
-        Tensor is_input, Tensor index, Tensor z, Tensor V)
+        Tensor is_input, Tensor index, Tensor z, Tensor V, Tensor S, Tensor W, Tensor Snrms,
+        c10::optional<Tensor> Sf)
+{
+	_MIX_CUDA_HEAD(V);
+
+    mix_t mix;
+    mix.b = V.size(0); mix.n = V.size(1); mix.m = S.size(1); mix.k = V.size(2);
+    mix.dtype = mix_dtype(S);
+    mix.is_input = iptr(is_input);
+    mix.index = iptr(index);
+    mix.z = fptr(z);
+    mix.V = fptr(V);
+    mix.S = vptr(S);
+    mix.W = fptr(W);
+    mix.Snrms = fptr(Snrms);
+#ifdef MIX_USE_GPU
+    // S widened to FP32 for the W = V'S GEMM
+    Tensor Sf_ = Sf.has_value() ? *Sf : Tensor();
+    mix.Sf_ready = Sf_.defined();
+    if (mix.dtype != MIX_FP32) {
+        if (mix.Sf_ready)
+            TORCH_CHECK(Sf_.scalar_type() == at::kFloat && Sf_.is_contiguous() && Sf_.size(0) == mix.n &&
+                    Sf_.size(1) == mix.m, "SATNet init: Sf must be a contiguous float32 ", mix.n, " x ", mix.m, " tensor");
+        else
+            Sf_ = torch::empty({mix.n, mix.m}, W.options());
+        mix.UVt = fptr(Sf_);
+    }
+#endif
+
+    // perm is either shared by the batch, (n-1), or per instance, (b, n-1)
+    const int perm_stride = perm.dim() == 2 ? mix.n-1 : 0;
+    _MIX_FUNC(mix_init_launcher)(mix, iptr(perm), perm_stride _MIX_CUDA_ARG);
+
+	_MIX_CUDA_TAIL;
+}
+
+// mix_init for the (V, W) of an earlier solve of the same S, where the inputs
+// flagged in changed (b x n) got a new is_input or z: only their rows of V
+// are set again, with matching rank-1 updates of W. index is drawn from perm,
+// and Snrms is left as that solve computed it.
+void mix_update(Tensor perm, Tensor changed,
+        Tensor is_input, Tensor index, Tensor z, Tensor V, Tensor S, Tensor W)
 {
-	_MIX_CUDA_HEAD;
+	_MIX_CUDA_HEAD(V);
 
     mix_t mix;
-    mix.b = V.size(0); mix.n = V.size(1); mix.k = V.size(2);
+    mix.b = V.size(0); mix.n = V.size(1); mix.m = S.size(1); mix.k = V.size(2);
+    mix.dtype = mix_dtype(S);
     mix.is_input = iptr(is_input);
     mix.index = iptr(index);
     mix.z = fptr(z);
     mix.V = fptr(V);
-    
-    _MIX_FUNC(mix_init_launcher)(mix, iptr(perm) _MIX_CUDA_ARG);
+    mix.S = vptr(S);
+    mix.W = fptr(W);
+    // the old rows of V, on CPU
+    Tensor cache = torch::empty({mix.b, mix.k}, V.options());
+    mix.cache = fptr(cache);
+
+    const int perm_stride = perm.dim() == 2 ? mix.n-1 : 0;
+    _MIX_FUNC(mix_update_launcher)(mix, iptr(perm), perm_stride, iptr(changed) _MIX_CUDA_ARG);
 
 	_MIX_CUDA_TAIL;
 }
 
+// queue, optional: the CUDA work-queue counter (1 int32), e.g. one per stream
+// of SATNetEngine; allocated per call otherwise.
 void mix_forward(int max_iter, float eps,
-        Tensor index, Tensor niter, Tensor S, Tensor z, Tensor V, Tensor W, Tensor gnrm, Tensor Snrms, Tensor cache)
+        Tensor index, Tensor niter, Tensor delta0, Tensor delta, Tensor S, Tensor z, Tensor V, Tensor W, Tensor gnrm, Tensor Snrms, Tensor cache,
+        c10::optional<Tensor> queue)
 {
-	_MIX_CUDA_HEAD;
+	_MIX_CUDA_HEAD(V);
 
     mix_t mix;
     mix.b = V.size(0); mix.n = V.size(1); mix.m = S.size(1); mix.k = V.size(2);
+    mix.dtype = mix_dtype(S);
     mix.index = iptr(index);
     mix.niter = iptr(niter);
-    mix.S = fptr(S);
+    mix.delta0 = fptr(delta0);
+    mix.delta = fptr(delta);
+    mix.S = vptr(S);
     mix.z = fptr(z);
     mix.V = fptr(V);
     mix.W = fptr(W);
     mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
     mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+    Tensor queue_ = queue.has_value() ? *queue : torch::empty({1}, index.options());
+    mix.queue = iptr(queue_);
+    mix.order = NULL;
+#endif
 
     _MIX_FUNC(mix_forward_launcher)(mix, max_iter, eps _MIX_CUDA_ARG);
 
 	_MIX_CUDA_TAIL;
 }
 
-void mix_backward(float prox_lam,
-        Tensor is_input, Tensor index, Tensor niter, Tensor S, Tensor dS, Tensor z, Tensor dz,
+void mix_backward(float prox_lam, int math, int max_iter, float eps,
+        Tensor is_input, Tensor index, Tensor niter, Tensor bw_niter, Tensor invalid, Tensor S, Tensor dS, Tensor z, Tensor dz,
         Tensor V, Tensor U, Tensor W, Tensor Phi, Tensor gnrm, Tensor Snrms, Tensor cache)
 {
-	_MIX_CUDA_HEAD;
+	_MIX_CUDA_HEAD(V);
 
     mix_t mix;
     mix.b = V.size(0); mix.n = V.size(1); mix.m = S.size(1); mix.k = V.size(2);
+    mix.dtype = mix_dtype(S);
     mix.is_input = iptr(is_input);
     mix.index = iptr(index);
     mix.niter = iptr(niter);
-    mix.S = fptr(S); mix.dS = fptr(dS);
+    mix.bw_niter = iptr(bw_niter);
+    mix.invalid = iptr(invalid);
+    mix.S = vptr(S); mix.dS = fptr(dS);
     mix.z = fptr(z); mix.dz = fptr(dz);
     mix.V = fptr(V); mix.U = fptr(U);
     mix.W = fptr(W); mix.Phi = fptr(Phi);
     mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
     mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+    Tensor UVt = torch::empty({2, mix.n, mix.b*mix.k}, V.options());
+    mix.UVt = fptr(UVt);
+    // longest instances first, so that no straggler is left for the tail
+    Tensor queue = torch::empty({1}, index.options());
+    Tensor order = niter.argsort(0, /*descending=*/true).to(at::kInt);
+    mix.queue = iptr(queue);
+    mix.order = iptr(order);
+#endif
 
-    _MIX_FUNC(mix_backward_launcher)(mix, prox_lam _MIX_CUDA_ARG);
+    _MIX_FUNC(mix_backward_launcher)(mix, prox_lam, max_iter, eps, math _MIX_CUDA_ARG);
 
 	_MIX_CUDA_TAIL;
 }
 
+// Inference only: z (b x n) is solved in place, and nothing else of the
+// solve outlives the call. V, W and the other solver buffers are scratch for
+// `chunk` instances at a time, so the peak memory of a large batch is bounded
+// by the chunk instead of b x (n + m) x k, and no U/Phi-sized buffer exists.
+void mix_solve(int max_iter, float eps, int chunk, int k,
+        Tensor perm, Tensor is_input, Tensor z, Tensor S)
+{
+	_MIX_CUDA_HEAD(z);
+
+    const int b = z.size(0), n = z.size(1), m = S.size(1);
+    const int c = std::min(b, std::max(chunk, 1));
+    auto fopts = z.options(), iopts = is_input.options();
+    Tensor V = torch::empty({c, n, k}, fopts), W = torch::empty({c, k, m}, fopts);
+    Tensor index = torch::empty({c, n}, iopts), niter = torch::empty({c}, iopts);
+    Tensor delta0 = torch::empty({c}, fopts), delta = torch::empty({c}, fopts);
+    Tensor gnrm = torch::empty({c, n}, fopts);
+    Tensor Snrms = torch::empty({n}, fopts), cache = torch::empty({c, k}, fopts);
+#ifdef MIX_USE_GPU
+    Tensor queue = torch::empty({1}, iopts);
+    // S widened to FP32 for the W = V'S GEMM
+    Tensor Sf;
+    if (mix_dtype(S) != MIX_FP32) Sf = torch::empty({n, m}, fopts);
+#endif
+    const int perm_stride = perm.dim() == 2 ? n-1 : 0;
+
+    for (int b0 = 0; b0 < b; b0 += c) {
+        mix_t mix;
+        mix.b = std::min(c, b-b0); mix.n = n; mix.m = m; mix.k = k;
+        mix.dtype = mix_dtype(S);
+        mix.is_input = iptr(is_input) + (long long)b0*n;
+        mix.z = fptr(z) + (long long)b0*n;
+        mix.index = iptr(index);
+        mix.niter = iptr(niter);
+        mix.delta0 = fptr(delta0.zero_());
+        mix.delta = fptr(delta);
+        mix.S = vptr(S);
+        mix.V = fptr(V.normal_());
+        mix.W = fptr(W);
+        mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
+        mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+        if (mix.dtype != MIX_FP32) mix.UVt = fptr(Sf);
+        mix.Sf_ready = b0 > 0; // widened by the first chunk
+        mix.queue = iptr(queue);
+        mix.order = NULL;
+#endif
+        _MIX_FUNC(mix_init_launcher)(mix, iptr(perm) + (long long)b0*perm_stride, perm_stride _MIX_CUDA_ARG);
+        _MIX_FUNC(mix_forward_launcher)(mix, max_iter, eps _MIX_CUDA_ARG);
+    }
+
+	_MIX_CUDA_TAIL;
+}
+
+// mix_solve for several problems at once, e.g. the layers of an ensemble on
+// one batch: problem p solves zs[p] (b_p x n_p) in place for Ss[p] (n_p x
+// m_p) at rank ks[p], with its own stopping rule. All of them run in one
+// launch (CUDA) or one parallel region (CPU) instead of one after the other.
+// S of every problem is ready to use (contiguous, padded), and on CUDA all of
+// them share one storage format.
+void mix_solve_grouped(std::vector<int> max_iters, std::vector<double> epss, std::vector<int> ks,
+        std::vector<Tensor> perms, std::vector<Tensor> is_inputs, std::vector<Tensor> zs, std::vector<Tensor> Ss)
+{
+    const size_t np = zs.size();
+    TORCH_CHECK(max_iters.size() == np && epss.size() == np && ks.size() == np && perms.size() == np &&
+            is_inputs.size() == np && Ss.size() == np, "SATNet solve_grouped: one entry per problem expected");
+    const int ngroup = np;
+    if (!ngroup) return;
+
+	_MIX_CUDA_HEAD(zs[0]);
+
+    std::vector<mix_group_t> group(ngroup);
+    std::vector<Tensor> keep; // the solver buffers, until the launch is done with them
+    auto fopts = zs[0].options(), iopts = is_inputs[0].options();
+#ifdef MIX_USE_GPU
+    Tensor queue = torch::empty({1}, iopts);
+#endif
+    for (int p = 0; p < ngroup; p++) {
+        const int b = zs[p].size(0), n = zs[p].size(1), m = Ss[p].size(1), k = ks[p];
+#ifdef MIX_USE_GPU
+        TORCH_CHECK(mix_dtype(Ss[p]) == mix_dtype(Ss[0]), "SATNet solve_grouped: the problems must share the dtype of S");
+#endif
+        Tensor V = torch::empty({b, n, k}, fopts).normal_(), W = torch::empty({b, k, m}, fopts);
+        Tensor index = torch::empty({b, n}, iopts), niter = torch::empty({b}, iopts);
+        Tensor delta0 = torch::zeros({b}, fopts), delta = torch::empty({b}, fopts);
+        Tensor gnrm = torch::empty({b, n}, fopts), Snrms = torch::empty({n}, fopts);
+        Tensor cache = torch::empty({b, k}, fopts);
+        keep.insert(keep.end(), {V, W, index, niter, delta0, delta, gnrm, Snrms, cache});
+
+        mix_t &mix = group[p].mix;
+        memset(&mix, 0, sizeof mix);
+        mix.b = b; mix.n = n; mix.m = m; mix.k = k;
+        mix.dtype = mix_dtype(Ss[p]);
+        mix.is_input = iptr(is_inputs[p]);
+        mix.index = iptr(index);
+        mix.niter = iptr(niter);
+        mix.delta0 = fptr(delta0);
+        mix.delta = fptr(delta);
+        mix.S = vptr(Ss[p]);
+        mix.z = fptr(zs[p]);
+        mix.V = fptr(V);
+        mix.W = fptr(W);
+        mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
+        mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+        // S widened to FP32 for the W = V'S GEMM
+        if (mix.dtype != MIX_FP32) {
+            keep.push_back(torch::empty({n, m}, fopts));
+            mix.UVt = fptr(keep.back());
+        }
+        mix.queue = iptr(queue);
+        mix.order = NULL;
+#endif
+        group[p].max_iter = max_iters[p];
+        group[p].eps = epss[p];
+        group[p].perm = iptr(perms[p]);
+        group[p].perm_stride = perms[p].dim() == 2 ? n-1 : 0;
+    }
+
+    _MIX_FUNC(mix_solve_grouped_launcher)(group.data(), ngroup _MIX_CUDA_ARG);
+
+	_MIX_CUDA_TAIL;
+}
+
+// Sparse S as CSR (Srow: n+1, Scol and Sval: nnz, int32/int32/float32). W
+// and Phi are b x m x k here, the transpose of the dense layout, and dS holds
+// the gradient of the nnz values only.
+void mix_init_sparse(Tensor perm,
+        Tensor is_input, Tensor index, Tensor z, Tensor V, Tensor Srow, Tensor Scol, Tensor Sval, Tensor W, Tensor Snrms)
+{
+	_MIX_CUDA_HEAD(V);
+
+    mix_t mix;
+    mix.b = V.size(0); mix.n = V.size(1); mix.m = W.size(1); mix.k = V.size(2);
+    mix.dtype = MIX_FP32;
+    mix.is_input = iptr(is_input);
+    mix.index = iptr(index);
+    mix.z = fptr(z);
+    mix.V = fptr(V);
+    mix.Srow = iptr(Srow); mix.Scol = iptr(Scol); mix.S = vptr(Sval);
+    mix.W = fptr(W);
+    mix.Snrms = fptr(Snrms);
+
+    const int perm_stride = perm.dim() == 2 ? mix.n-1 : 0;
+    _MIX_FUNC(mix_init_sparse_launcher)(mix, iptr(perm), perm_stride _MIX_CUDA_ARG);
+
+	_MIX_CUDA_TAIL;
+}
+
+// queue: see mix_forward
+void mix_forward_sparse(int max_iter, float eps,
+        Tensor index, Tensor niter, Tensor delta0, Tensor delta, Tensor Srow, Tensor Scol, Tensor Sval, Tensor z, Tensor V, Tensor W, Tensor gnrm, Tensor Snrms, Tensor cache,
+        c10::optional<Tensor> queue)
+{
+	_MIX_CUDA_HEAD(V);
+
+    mix_t mix;
+    mix.b = V.size(0); mix.n = V.size(1); mix.m = W.size(1); mix.k = V.size(2);
+    mix.dtype = MIX_FP32;
+    mix.index = iptr(index);
+    mix.niter = iptr(niter);
+    mix.delta0 = fptr(delta0);
+    mix.delta = fptr(delta);
+    mix.Srow = iptr(Srow); mix.Scol = iptr(Scol); mix.S = vptr(Sval);
+    mix.z = fptr(z);
+    mix.V = fptr(V);
+    mix.W = fptr(W);
+    mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
+    mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+    Tensor queue_ = queue.has_value() ? *queue : torch::empty({1}, index.options());
+    mix.queue = iptr(queue_);
+    mix.order = NULL;
+#endif
+
+    _MIX_FUNC(mix_forward_sparse_launcher)(mix, max_iter, eps _MIX_CUDA_ARG);
+
+	_MIX_CUDA_TAIL;
+}
+
+void mix_backward_sparse(float prox_lam, int max_iter, float eps,
+        Tensor is_input, Tensor index, Tensor niter, Tensor bw_niter, Tensor invalid, Tensor Srow, Tensor Scol, Tensor Sval, Tensor dSval, Tensor z, Tensor dz,
+        Tensor V, Tensor U, Tensor W, Tensor Phi, Tensor gnrm, Tensor Snrms, Tensor cache)
+{
+	_MIX_CUDA_HEAD(V);
+
+    mix_t mix;
+    mix.b = V.size(0); mix.n = V.size(1); mix.m = W.size(1); mix.k = V.size(2);
+    mix.dtype = MIX_FP32;
+    mix.is_input = iptr(is_input);
+    mix.index = iptr(index);
+    mix.niter = iptr(niter);
+    mix.bw_niter = iptr(bw_niter);
+    mix.invalid = iptr(invalid);
+    mix.Srow = iptr(Srow); mix.Scol = iptr(Scol);
+    mix.S = vptr(Sval); mix.dS = fptr(dSval);
+    mix.z = fptr(z); mix.dz = fptr(dz);
+    mix.V = fptr(V); mix.U = fptr(U);
+    mix.W = fptr(W); mix.Phi = fptr(Phi);
+    mix.gnrm = fptr(gnrm); mix.Snrms = fptr(Snrms);
+    mix.cache = fptr(cache);
+#ifdef MIX_USE_GPU
+    Tensor queue = torch::empty({1}, index.options());
+    Tensor order = niter.argsort(0, /*descending=*/true).to(at::kInt);
+    mix.queue = iptr(queue);
+    mix.order = iptr(order);
+#endif
+
+    _MIX_FUNC(mix_backward_sparse_launcher)(mix, prox_lam, max_iter, eps _MIX_CUDA_ARG);
+
+	_MIX_CUDA_TAIL;
+}
+
+#ifndef MIX_USE_GPU
+// Solver state file, see SolverState.save: a fixed header followed by the
+// raw arrays in host byte order, each at a 64-byte aligned offset recorded in
+// the header, so a file can be memory-mapped (e.g. numpy.memmap) as well as
+// read back by mix_state_load. The arrays are CPU tensors of float32 or int32.
+const char MIX_STATE_MAGIC[8] = {'S', 'A', 'T', 'N', 'E', 'T', 'S', 'T'};
+const int MIX_STATE_VERSION = 1;
+const int MIX_STATE_MAX_ARRAYS = 16, MIX_STATE_MAX_DIM = 4, MIX_STATE_ALIGN = 64;
+
+typedef struct mix_state_array_t {
+    int32_t dtype;  // 0: float32, 1: int32
+    int32_t ndim;
+    int64_t shape[MIX_STATE_MAX_DIM];
+    int64_t offset; // bytes from the start of the file
+} mix_state_array_t;
+
+typedef struct mix_state_header_t {
+    char magic[8];
+    int32_t version, narrays;
+    int64_t seed;
+    mix_state_array_t array[MIX_STATE_MAX_ARRAYS];
+} mix_state_header_t;
+
+static int64_t mix_state_align(int64_t x) { return (x + MIX_STATE_ALIGN-1) / MIX_STATE_ALIGN * MIX_STATE_ALIGN; }
+
+void mix_state_save(const std::string &path, int64_t seed, std::vector<Tensor> arrays)
+{
+    TORCH_CHECK(arrays.size() <= MIX_STATE_MAX_ARRAYS, "SATNet state: at most ", MIX_STATE_MAX_ARRAYS, " arrays");
+    mix_state_header_t h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MIX_STATE_MAGIC, sizeof h.magic);
+    h.version = MIX_STATE_VERSION;
+    h.narrays = arrays.size();
+    h.seed = seed;
+    int64_t offset = mix_state_align(sizeof h), end = sizeof h;
+    for (int a = 0; a < h.narrays; a++) {
+        Tensor &t = arrays[a];
+        TORCH_CHECK(t.device().is_cpu() && t.is_contiguous(), "SATNet state: array ", a, " is not a contiguous CPU tensor");
+        TORCH_CHECK(t.scalar_type() == at::kFloat || t.scalar_type() == at::kInt,
+                "SATNet state: unsupported dtype ", t.scalar_type());
+        TORCH_CHECK(t.dim() <= MIX_STATE_MAX_DIM, "SATNet state: array ", a, " has more than ", MIX_STATE_MAX_DIM, " dims");
+        h.array[a].dtype = t.scalar_type() == at::kInt;
+        h.array[a].ndim = t.dim();
+        for (int d = 0; d < t.dim(); d++) h.array[a].shape[d] = t.size(d);
+        h.array[a].offset = offset;
+        end = offset + t.nbytes();
+        offset = mix_state_align(end);
+    }
+
+    FILE *f = fopen(path.c_str(), "wb");
+    TORCH_CHECK(f, "SATNet state: cannot open ", path, " for writing");
+    bool ok = fwrite(&h, sizeof h, 1, f) == 1;
+    for (int a = 0; ok && a < h.narrays; a++) {
+        ok = fseek(f, h.array[a].offset, SEEK_SET) == 0 &&
+             fwrite(arrays[a].data_ptr(), 1, arrays[a].nbytes(), f) == arrays[a].nbytes();
+    }
+    // pad the file to the aligned end of the last array
+    if (ok && end < offset) ok = fseek(f, offset-1, SEEK_SET) == 0 && fputc(0, f) == 0;
+    ok = fclose(f) == 0 && ok;
+    TORCH_CHECK(ok, "SATNet state: failed to write ", path);
+}
+
+std::tuple<int64_t, std::vector<Tensor>> mix_state_load(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    TORCH_CHECK(f, "SATNet state: cannot open ", path);
+    // every array must lie inside the file before anything is allocated for it
+    const int64_t size = fseek(f, 0, SEEK_END) == 0 ? (int64_t)ftell(f) : -1;
+    rewind(f);
+    mix_state_header_t h;
+    memset(&h, 0, sizeof h);
+    const bool magic = fread(&h, sizeof h, 1, f) == 1 && !memcmp(h.magic, MIX_STATE_MAGIC, sizeof h.magic);
+    bool ok = magic && h.version == MIX_STATE_VERSION && h.narrays >= 0 && h.narrays <= MIX_STATE_MAX_ARRAYS;
+
+    std::vector<Tensor> arrays;
+    for (int a = 0; ok && a < h.narrays; a++) {
+        const mix_state_array_t &e = h.array[a];
+        ok = (e.dtype == 0 || e.dtype == 1) && e.ndim >= 0 && e.ndim <= MIX_STATE_MAX_DIM;
+        // float32 and int32 are both 4 bytes; nbytes <= size bounds every product
+        int64_t nbytes = 4;
+        for (int d = 0; ok && d < e.ndim; d++) {
+            ok = e.shape[d] >= 0 && (e.shape[d] == 0 || nbytes <= size / e.shape[d]);
+            if (ok) nbytes *= e.shape[d];
+        }
+        ok = ok && e.offset >= (int64_t)sizeof h && e.offset <= size - nbytes;
+        if (!ok) break;
+        Tensor t = torch::empty(std::vector<int64_t>(e.shape, e.shape + e.ndim),
+                torch::dtype(e.dtype ? at::kInt : at::kFloat));
+        ok = fseek(f, e.offset, SEEK_SET) == 0 && fread(t.data_ptr(), 1, t.nbytes(), f) == t.nbytes();
+        arrays.push_back(t);
+    }
+    fclose(f);
+    TORCH_CHECK(magic, "SATNet state: ", path, " is not a solver state file");
+    TORCH_CHECK(h.version == MIX_STATE_VERSION, "SATNet state: ", path, " has version ", h.version,
+            ", expected ", MIX_STATE_VERSION);
+    TORCH_CHECK(ok, "SATNet state: ", path, " is truncated or corrupt");
+    return std::make_tuple(h.seed, arrays);
+}
+#endif
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.def("init" , &mix_init, "SATNet init (" _MIX_DEV_STR ")");
+    m.def("update" , &mix_update, "SATNet init for changed inputs (" _MIX_DEV_STR ")");
     m.def("forward" , &mix_forward, "SATNet forward (" _MIX_DEV_STR ")");
     m.def("backward" , &mix_backward, "SATNet backward (" _MIX_DEV_STR ")");
+    m.def("solve" , &mix_solve, "SATNet inference-only forward (" _MIX_DEV_STR ")");
+    m.def("solve_grouped" , &mix_solve_grouped, "SATNet inference-only forward of several problems (" _MIX_DEV_STR ")");
+    m.def("init_sparse" , &mix_init_sparse, "SATNet init, CSR S (" _MIX_DEV_STR ")");
+    m.def("forward_sparse" , &mix_forward_sparse, "SATNet forward, CSR S (" _MIX_DEV_STR ")");
+    m.def("backward_sparse" , &mix_backward_sparse, "SATNet backward, CSR S (" _MIX_DEV_STR ")");
+#ifndef MIX_USE_GPU
+    m.def("simd_isa" , [] { return std::string(simd.isa); }, "SIMD kernels selected for this CPU");
+    m.def("state_save" , &mix_state_save, "Write a SATNet solver state file");
+    m.def("state_load" , &mix_state_load, "Read a SATNet solver state file");
+#endif
 }
@@ -1,12 +1,62 @@
 typedef struct mix_t {
     int b, n, m, k;
+    int dtype;          // storage of S, see MIX_FP32
     int32_t *is_input;  // b*n
     int32_t *index;     // b*n
     int32_t *niter;     // b
-    float *S, *dS;      // n*m
+    int32_t *bw_niter;  // b, sweeps of the backward pass, see mix_backward
+    float *delta0;      // b, decrease of the first sweep, see mix_forward
+    float *delta;       // b, decrease of the last sweep
+    int32_t *invalid;   // b, MIX_VALID or why the backward pass dropped it
+    void *S; float *dS; // n*m, dS summed over the batch
     float *z, *dz;      // b*n
     float *V, *U;       // b*n*k
     float *W, *Phi;     // b*m*k
     float *gnrm, *Snrms;// b*n
     float *cache;
+    float *UVt;         // CUDA scratch: 2*n*b*k for the dS GEMM, n*m for init
+    int Sf_ready;       // CUDA init: UVt already holds a 16-bit S widened to FP32
+    int32_t *queue;     // CUDA work-queue counter, see mix_next_instance
+    int32_t *order;     // b, order the queue hands out instances, NULL: 0..b-1
+    int32_t *Srow;      // n+1, CSR row pointers of a sparse S, see mix_kernel_sparse
+    int32_t *Scol;      // nnz, CSR columns; S and dS then hold the nnz values
 } mix_t ;
+
+// One problem of a grouped solve, see mix_solve_grouped: every problem has
+// its own S, sizes, batch and stopping rule, and its instances are the
+// first..first+mix.b-1 of the group's work list.
+typedef struct mix_group_t {
+    mix_t mix;
+    int max_iter;
+    float eps;
+    int32_t *perm;      // (n-1) or (b, n-1), see mix_init
+    int perm_stride;
+    int first;
+    int mbuf;           // CUDA: columns of W kept in shared memory
+} mix_group_t;
+
+// Storage formats of S. The 16-bit formats halve the traffic of the rows of S
+// streamed through the mixing kernels; W, Phi and all arithmetic stay FP32,
+// since rounding W after every coordinate update stalls the descent.
+enum { MIX_FP32 = 0, MIX_FP16 = 1, MIX_BF16 = 2 };
+
+// Outcome of the backward pass of an instance. An invalid gradient (dz/sin(pi
+// z) not finite or a vanishing g in eq.8, or a U that is not finite) zeroes
+// the instance's dz and drops it from dS.
+enum { MIX_VALID = 0, MIX_INVALID_DZ = 1, MIX_INVALID_U = 2 };
+
+// Math mode of the dS GEMM on CUDA
+enum { MIX_MATH_FP32 = 0, MIX_MATH_TF32 = 1, MIX_MATH_FP16 = 2 };
+
+// Runs the statement in __VA_ARGS__ with a compile-time rank K. The kernels
+// are specialized for k in {4, 8, 16, 32, 64}; any other k runs the generic
+// instantiation K = 0, which reads the rank from mix.k.
+#define MIX_SWITCH_K(k, ...) \
+    switch (k) { \
+        case 4:  { constexpr int K = 4;  __VA_ARGS__; } break; \
+        case 8:  { constexpr int K = 8;  __VA_ARGS__; } break; \
+        case 16: { constexpr int K = 16; __VA_ARGS__; } break; \
+        case 32: { constexpr int K = 32; __VA_ARGS__; } break; \
+        case 64: { constexpr int K = 64; __VA_ARGS__; } break; \
+        default: { constexpr int K = 0;  __VA_ARGS__; } break; \
+    }
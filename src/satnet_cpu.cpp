@@ -1,63 +1,53 @@
 #include <assert.h>
 #include <float.h>
 #include <math.h>
-#include <smmintrin.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <xmmintrin.h>
 
 #include <omp.h>
 
 #include "satnet.h"
+#include "satnet_simd.h"
 
 #define saxpy mysaxpy
 #define scopy myscopy
 #define sscal mysscal
 #define sdot mysdot
+#define sdotk mysdotk
 #define snrm2 mysnrm2
 #define szero myszero
 #define saturate mysaturate
 
 const double MEPS = 1e-24;
+// Smallest share of W (floats) worth a thread of its own inside an instance,
+// see mix_team_size. Below it the barrier per coordinate costs more than the
+// thread saves.
+const int TEAM_MIN_FLOATS = 16384;
+// Floats of W per tile of mix_kernel, see mix_tile_cols: 16KB, a third to a
+// half of a typical L1 data cache.
+const int TILE_FLOATS = 4096;
 
-// The saxpy function performs the operation y =a*x+y for vectors x and y of
-// length l. The implementation provided uses SIMD (Single Instruction, Multiple
-// Data) instructions to speed up the computation, specifically using the SSE
-// (Streaming SIMD Extensions) instructions for floating-point operations.
-void saxpy(float *__restrict__ y, float a, const float *__restrict__ x, int l) {
-  y = (float *)__builtin_assume_aligned(y, 4 * sizeof(float));
-  x = (float *)__builtin_assume_aligned(x, 4 * sizeof(float));
-  __m128 const a_ = _mm_set1_ps(a);
-  for (int i = 0; i < l; i += 4, x += 4, y += 4) {
-    __m128 y_ = _mm_load_ps(y);
-    __m128 x_ = _mm_load_ps(x);
-    y_ = _mm_add_ps(_mm_mul_ps(a_, x_), y_);
-    _mm_store_ps(y, y_);
-  }
+// saxpy (y = a*x + y) and sdot run on the widest SIMD kernels available on
+// the host; see satnet_simd.cpp for the x86 and ARM implementations.
+inline void saxpy(float *__restrict__ y, float a, const float *__restrict__ x,
+                  int l) {
+  simd.axpy(y, a, x, l);
 }
 
 void scopy(float *x, float *y, int l) { memcpy(y, x, sizeof(*x) * (size_t)l); }
 
-float sdot(const float *__restrict__ x, const float *__restrict__ y, int l) {
-  // The sdot function computes the dot product of two aligned float arrays
-  // using SIMD (Single Instruction, Multiple Data) instructions for efficiency.
-  // This function takes advantage of the SIMD capabilities provided by the SSE
-  // (Streaming SIMD Extensions) instructions in the x86 architecture.
-  x = (float *)__builtin_assume_aligned(x, 4 * sizeof(float));
-  y = (float *)__builtin_assume_aligned(y, 4 * sizeof(float));
-  __m128 s = _mm_set1_ps(0);
-  for (int i = 0; i < l; i += 4, x += 4, y += 4) {
-    __m128 x_ = _mm_load_ps(x);
-    __m128 y_ = _mm_load_ps(y);
-    __m128 t = _mm_dp_ps(x_, y_, 0xf1);
-    s = _mm_add_ss(s, t);
-  }
-  float s_;
-  _mm_store_ss(&s_, s);
+inline float sdot(const float *__restrict__ x, const float *__restrict__ y,
+                  int l) {
+  return simd.dot(x, y, l);
+}
 
-  return s_;
+// sdotk computes the k dot products out[kk] = x'Y[kk*l:(kk+1)*l] in one pass,
+// so each chunk of x is loaded once for several rows of Y.
+inline void sdotk(const float *__restrict__ x, const float *__restrict__ Y,
+                  int l, int k, float *__restrict__ out) {
+  simd.dotk(x, Y, l, k, out);
 }
 
 // The sscal function scales a float array x with length l by a scalar value
@@ -85,6 +75,84 @@ float snrm2(const float *x, int l) {
 }
 void szero(float *v, int l) { memset(v, 0, l * sizeof(*v)); }
 
+// S may be stored as 16-bit T = half_t or bfloat16_t (see MixingFunc's
+// dtype). srow returns row x of S as FP32, widened into buf unless it already
+// is; W, Phi and all arithmetic stay FP32.
+inline const float *srow(const float *x, float *buf, int l) { return x; }
+
+inline const float *srow(const half_t *x, float *__restrict__ buf, int l) {
+  simd.load_f16((const uint16_t *)x, buf, l);
+  return buf;
+}
+
+inline const float *srow(const bfloat16_t *x, float *__restrict__ buf, int l) {
+  simd.load_bf16((const uint16_t *)x, buf, l);
+  return buf;
+}
+
+// Runs the statement in __VA_ARGS__ with T the C++ type of S
+#define MIX_SWITCH_T(dtype, ...)                                              \
+  switch (dtype) {                                                            \
+  case MIX_FP16: { typedef half_t T; __VA_ARGS__; } break;                    \
+  case MIX_BF16: { typedef bfloat16_t T; __VA_ARGS__; } break;                \
+  default: { typedef float T; __VA_ARGS__; } break;                           \
+  }
+
+// Helpers for the short length-k vectors (g, Vi). k is far smaller than m, so
+// inlined loops beat a call into the dispatched kernels, and when the rank is
+// a compile-time constant (see MIX_SWITCH_K) they unroll completely.
+inline float kdot(const float *__restrict__ x, const float *__restrict__ y,
+                  int k) {
+  float s = 0;
+#pragma omp simd reduction(+ : s)
+  for (int kk = 0; kk < k; kk++)
+    s += x[kk] * y[kk];
+  return s;
+}
+
+inline void kaxpy(float *__restrict__ y, float a, const float *__restrict__ x,
+                  int k) {
+#pragma omp simd
+  for (int kk = 0; kk < k; kk++)
+    y[kk] += a * x[kk];
+}
+
+inline void kscal(float *x, float a, int k) {
+#pragma omp simd
+  for (int kk = 0; kk < k; kk++)
+    x[kk] *= a;
+}
+
+// The part of mix_init for vi: set from zi for an input, normalized otherwise
+void mix_init_v(int i, int k, const int32_t *is_input, const float *z,
+                float *V) {
+  if (is_input[i]) {
+    float Vi1 = V[i * k + 1];
+    szero(V + i * k, k); // sets the i-th vector of V to zero.
+    V[i * k] = -cos(z[i] * M_PI);
+    V[i * k + 1] = copysign(sin(z[i] * M_PI), Vi1);
+  } else {
+    float s = sdot(V + i * k, V + i * k, k);
+    s = 1 / sqrtf(s);
+    sscal(V + i * k, s, k);
+  }
+}
+
+// The part of mix_init for index: the output variables in the order of perm,
+// zero-terminated.
+void mix_init_index(const int32_t *perm, int n, const int32_t *is_input,
+                    int32_t *index) {
+  // added some randomness in the coordinate decent, only permute the output
+  int i_ = 0, j = 0;
+  for (; i_ < n - 1; i_++) {
+    int i = perm[i_] + 1;
+    if (!is_input[i])
+      index[j++] = i;
+  }
+  for (; j < n; j++)
+    index[j] = 0;
+}
+
 void mix_init(int32_t *perm, int n, int k, const int32_t *is_input,
               int32_t *index, const float *z, float *V) {
   // The mix_init function initializes and transforms the V matrix based on the
@@ -96,113 +164,303 @@ void mix_init(int32_t *perm, int n, int k, const int32_t *is_input,
   // initilization process complies with eq. 4&5
 
   // rand_unit(V+0, k);
-  for (int i = 0; i < n; i++) {
-    if (is_input[i]) {
-      float Vi1 = V[i * k + 1];
-      szero(V + i * k, k); // sets the i-th vector of V to zero.
-      V[i * k] = -cos(z[i] * M_PI);
-      V[i * k + 1] = copysign(sin(z[i] * M_PI), Vi1);
-    } else {
-      float s = sdot(V + i * k, V + i * k, k);
-      s = 1 / sqrtf(s);
-      sscal(V + i * k, s, k);
-    }
+  for (int i = 0; i < n; i++)
+    mix_init_v(i, k, is_input, z, V);
+  mix_init_index(perm, n, is_input, index);
+}
+
+// Algo2/3 line 7-8 for the coordinate i, given g = W Si - Sii vi (Phi and ui
+// in the backward pass): sets vi to its new value and g to vi^new - vi^old.
+// Returns the step size 1/gnrmi was taken with, |g| in the forward pass.
+template <int K>
+inline float mix_update_v(int is_forward, float prox_lam, int k_, int i,
+                          const float *__restrict__ dz, float *__restrict__ V,
+                          const float *__restrict__ Vproj,
+                          const float *__restrict__ gnrm,
+                          float *__restrict__ g) {
+  const int k = K ? K : k_;
+  float gnrmi;
+  if (is_forward) {
+    // algo2 line7: vo=-go/norm(go)
+    gnrmi = sqrtf(kdot(g, g, k));
+    kscal(g, -1, k);
+  } else {
+    // algo3 line7: g = -(I-v_i v_i') (g+v_0 dz[i])
+    // this part is very tricky, for detailed alignment, please refer to .md
+    // file
+    gnrmi = gnrm[i] + prox_lam;
+    float c = kdot(Vproj + i * k, g, k) + dz[i] * Vproj[i * k];
+    kscal(g, -1, k);
+    kaxpy(g, c, Vproj + i * k, k);
+    g[0] -= dz[i];
   }
-  // added some randomness in the coordinate decent, only permute the output
-  int i_ = 0, j = 0;
-  for (; i_ < n - 1; i_++) {
-    int i = perm[i_] + 1;
-    if (!is_input[i])
-      index[j++] = i;
+  kscal(g, 1 / gnrmi, k);
+
+  float t;
+  // algo2: cooresponds to line 7's assignment, and line8's calculation
+  // define a temprory var, set vo_new = g, and store vo_new-vo_old into g
+  // algo3 line 7 & 8
+  for (int kk = 0; kk < k; kk++)
+    t = g[kk], g[kk] -= V[i * k + kk], V[i * k + kk] = t;
+  return gnrmi;
+}
+
+// mix_kernel keeps W (Phi in the backward pass) in tiles of mb columns: the
+// columns [j0, j0+nb) are the row-major k x nb block at W + j0*k, with nb = mb
+// except for the last tile. A tile is k*mb <= TILE_FLOATS floats, small enough
+// to stay in L1 between its update and its dot products. With mb = m the tiled
+// layout is W itself.
+int mix_tile_cols(int m, int k) {
+  int mb = TILE_FLOATS / k / 16 * 16;
+  if (mb < 16)
+    mb = 16;
+  return mb < m ? mb : m;
+}
+
+void mix_tile(int m, int k, int mb, float *W, float *Wt) {
+  for (int j0 = 0; j0 < m; j0 += mb) {
+    const int nb = j0 + mb < m ? mb : m - j0;
+    for (int kk = 0; kk < k; kk++)
+      scopy(W + kk * m + j0, Wt + j0 * k + kk * nb, nb);
   }
-  for (; j < n; j++)
-    index[j] = 0;
 }
 
-float mix_kernel(int is_forward, float prox_lam, int m, int k,
-                 const int32_t *__restrict__ index, const float *__restrict__ S,
+void mix_untile(int m, int k, int mb, float *Wt, float *W) {
+  for (int j0 = 0; j0 < m; j0 += mb) {
+    const int nb = j0 + mb < m ? mb : m - j0;
+    for (int kk = 0; kk < k; kk++)
+      scopy(Wt + j0 * k + kk * nb, W + kk * m + j0, nb);
+  }
+}
+
+// Per-thread scratch of mix_forward and mix_backward: 2*k floats for g, 2*m
+// for the widened rows of S and, when m spans several tiles, k*m for the tiled
+// copy of W.
+size_t mix_scratch_floats(int m, int k) {
+  return 2 * ((size_t)k + m) +
+         (mix_tile_cols(m, k) < m ? (size_t)k * m : 0);
+}
+
+// One pass over the tiles of W: W += dv Sp' (the update of the previous
+// coordinate) if Sp is given, then g = W Sn (the gradient of the next one) if
+// Sn is. Each tile is dotted right after its update, while it is still in
+// L1, so W streams through the cache once per coordinate instead of twice.
+template <int K>
+inline void mix_pass(int m, int k_, int mb, float *__restrict__ W,
+                     const float *__restrict__ dv,
+                     const float *__restrict__ Sp,
+                     const float *__restrict__ Sn, float *__restrict__ g,
+                     float *__restrict__ part) {
+  const int k = K ? K : k_;
+  for (int j0 = 0; j0 < m; j0 += mb) {
+    const int nb = j0 + mb < m ? mb : m - j0;
+    float *__restrict__ Wj = W + j0 * k;
+    if (Sp) {
+      for (int kk = 0; kk < k; kk++)
+        saxpy(Wj + kk * nb, dv[kk], Sp + j0, nb);
+    }
+    if (Sn) {
+      sdotk(Sn + j0, Wj, nb, k, j0 ? part : g);
+      if (j0)
+        kaxpy(g, 1, part, k);
+    }
+  }
+}
+
+// W is tiled as above. g is a k-float buffer and buf the scratch of
+// mix_scratch_floats less the tiled W.
+template <int K, typename T>
+float mix_kernel(int is_forward, float prox_lam, int m, int k_, int mb,
+                 const int32_t *__restrict__ index, const T *__restrict__ S,
                  const float *__restrict__ dz, float *__restrict__ V,
                  const float *__restrict__ Vproj, float *__restrict__ W,
                  float *__restrict__ gnrm, const float *__restrict__ Snrms,
-                 float *__restrict__ g) {
+                 float *g, float *buf) {
   // this function is for both Algo2 (forward pass) and 3 (backward pass),
   // in backward pass, U is mapped to V, V is mapped to Vproj (to
   // calculate P), phi is mapped to W, dg is mapped to g
+  const int k = K ? K : k_;
+  float *gn = buf, *part = buf + k, *Sbuf = buf + 2 * k;
   float delta = 0;
-  for (int i, i_ = 0; (i = index[i_]); i_++) {
-    const float Sii = Snrms[i];
-    const float *__restrict__ Si = S + i * m;
+  int i = index[0];
+  if (!i)
+    return 0;
 
-    // Algo2 line6: go = W'So - Snorm^2*vo,
-    // dim: g: kx1, Si: mx1, W: kxm, Sii: scalar, V: nxk
-    // first part of line6: p1=omega*so
-    // Algo3 line6: dgo = phi'So - Snorm^2*uo
-    for (int kk = 0; kk < k; kk++)
-      g[kk] = sdot(Si, W + kk * m, m);
+  // Algo2 line6: go = W'So - Snorm^2*vo,
+  // dim: g: kx1, Si: mx1, W: kxm, Sii: scalar, V: nxk
+  // first part of line6: p1=omega*so, for the first coordinate on its own and
+  // for the others fused with the update of the previous one
+  // Algo3 line6: dgo = phi'So - Snorm^2*uo
+  const float *Si = srow(S + i * m, Sbuf, m);
+  mix_pass<K>(m, k, mb, W, NULL, NULL, Si, g, part);
+  for (int i_ = 0; i; i_++) {
     // second part: p1 -s_norm^2*vo, y=p1, a=-s_norm^2, x=vo
-    saxpy(g, -Sii, V + i * k, k);
+    kaxpy(g, -Snrms[i], V + i * k, k);
+
+    const float gnrmi =
+        mix_update_v<K>(is_forward, prox_lam, k, i, dz, V, Vproj, gnrm, g);
+    // Calc function decrease: gnrmi represents gradient size, sdot(g, g, k)
+    // represents vo difference size (vo difference is stored in g). The
+    // backward pass sums the plain |ui^new-ui^old|^2 for its stopping rule.
+    delta += (is_forward ? gnrmi : 1) * kdot(g, g, k);
+    if (is_forward)
+      gnrm[i] = gnrmi;
+
+    // W += (vi^new-vi^old) Si', and the W Si of the next coordinate
+    const int inext = index[i_ + 1];
+    const float *Sn =
+        inext ? srow(S + inext * m, Sbuf + (i_ + 1) % 2 * m, m) : NULL;
+    mix_pass<K>(m, k, mb, W, g, Si, Sn, gn, part);
+    float *t = g;
+    g = gn, gn = t;
+    Si = Sn, i = inext;
+  }
+  return delta;
+}
+
+// A team of threads solving one instance together, for batches smaller than
+// the thread count. Thread `rank` owns the rows [k0, k1) of W (Phi in the
+// backward pass) and of every vi, so the W updates need no locks; only g is
+// shared.
+typedef struct mix_team_t {
+  int rank, size, k0, k1;
+  float *g;     // 2*k, gradient shared by the team, double buffered
+  float *delta; // size, function decrease of every thread
+  float *Sbuf;  // m, this thread's widened row of S
+} mix_team_t;
 
-    float gnrmi;
+// To be called by every thread of the team's parallel region.
+mix_team_t mix_team_begin(int m, int k, float *g, float *delta) {
+  mix_team_t t;
+  t.rank = omp_get_thread_num();
+  t.size = omp_get_num_threads();
+  t.k0 = t.rank * k / t.size;
+  t.k1 = (t.rank + 1) * k / t.size;
+  t.g = g;
+  t.delta = delta;
+  t.Sbuf = (float *)malloc((size_t)m * sizeof(float));
+  return t;
+}
+
+void mix_team_end(mix_team_t &t) { free(t.Sbuf); }
+
+// mix_kernel for a team: every thread computes its own rows of g, and after
+// one barrier every thread reads all of g for the norm (or the projection of
+// the backward pass) and updates its own rows of vi and W. g alternates
+// between two buffers, so a thread may start the next coordinate while the
+// others still read the previous g.
+template <int K, typename T>
+float mix_kernel_team(const mix_team_t &t, int is_forward, float prox_lam,
+                      int m, int k_, const int32_t *__restrict__ index,
+                      const T *__restrict__ S, const float *__restrict__ dz,
+                      float *__restrict__ V, const float *__restrict__ Vproj,
+                      float *__restrict__ W, float *__restrict__ gnrm,
+                      const float *__restrict__ Snrms) {
+  const int k = K ? K : k_;
+  const int k0 = t.k0, nk = t.k1 - t.k0;
+  float delta = 0;
+  int p = 0;
+  for (int i, i_ = 0; (i = index[i_]); i_++, p ^= 1) {
+    float *__restrict__ g = t.g + p * k;
+    const float Sii = Snrms[i];
+    const float *__restrict__ Si = srow(S + i * m, t.Sbuf, m);
+
+    // own rows of g = W Si - Sii vi
+    sdotk(Si, W + k0 * m, m, nk, g + k0);
+    kaxpy(g + k0, -Sii, V + i * k + k0, nk);
+#pragma omp barrier
+
+    // vi_new = -g/|g| (forward) or -(I-v_i v_i')(g+v_0 dz[i])/(gnrm+lam)
+    float gnrmi, c = 0;
     if (is_forward) {
-      // algo2 line7: vo=-go/norm(go)
-      gnrmi = snrm2(g, k);
-      sscal(g, -1, k);
+      gnrmi = sqrtf(kdot(g, g, k));
     } else {
-      // algo3 line7: g = -(I-v_i v_i') (g+v_0 dz[i])
-      // this part is very tricky, for detailed alignment, please refer to .md
-      // file
       gnrmi = gnrm[i] + prox_lam;
-      float c = sdot(Vproj + i * k, g, k) + dz[i] * Vproj[i * k];
-      sscal(g, -1, k);
-      saxpy(g, c, Vproj + i * k, k);
-      g[0] -= dz[i];
+      c = kdot(Vproj + i * k, g, k) + dz[i] * Vproj[i * k];
     }
-    sscal(g, 1 / gnrmi, k);
+    const float r = 1 / gnrmi;
 
-    float t;
-    // algo2: cooresponds to line 7's assignment, and line8's calculation
-    // define a temprory var, set vo_new = g, and store vo_new-vo_old into g
-    // algo3 line 7 & 8
-    for (int kk = 0; kk < k; kk++)
-      t = g[kk], g[kk] -= V[i * k + kk], V[i * k + kk] = t;
-    // W += (vi^new-vi^old) Si'
-    for (int kk = 0; kk < k; kk++)
-      saxpy(W + kk * m, g[kk], Si, m);
+    float dd = 0;
+    for (int kk = t.k0; kk < t.k1; kk++) {
+      float v = -g[kk];
+      if (!is_forward)
+        v += c * Vproj[i * k + kk] - (kk == 0) * dz[i];
+      v *= r;
+      // W += (vi^new-vi^old) Si'
+      const float dv = v - V[i * k + kk];
+      V[i * k + kk] = v;
+      saxpy(W + kk * m, dv, Si, m);
+      dd += dv * dv;
+    }
 
-    if (is_forward) {
-      // Calc function decrease: gnrmi represents gradient size, sdot(g, g, k)
-      // represents vo difference size (vo difference is stored in g)
-      delta += gnrmi * sdot(g, g, k);
+    delta += (is_forward ? gnrmi : 1) * dd;
+    if (is_forward && t.rank == 0)
       gnrm[i] = gnrmi;
-    }
   }
+
+  // every thread returns the same total, so the team stops together
+  t.delta[t.rank] = delta;
+#pragma omp barrier
+  delta = 0;
+  for (int r = 0; r < t.size; r++)
+    delta += t.delta[r];
+#pragma omp barrier
   return delta;
 }
 
 // clamp a floating-point value x within the range [0, 1].
 inline float saturate(float x) { return x - (x < 0) * x + (x > 1) * (1 - x); }
 
-// consider the \min unsat problem,
-void mix_forward(int max_iter, float eps, int n, int m, int k,
-                 const int32_t *index, int32_t *niter, const float *S, float *z,
-                 float *V, float *W, float *gnrm, float *Snrms, float *cache) {
-  float delta;
+// Runs sweeps of the mixing method (algo2 line4) until the function decrease
+// of a sweep drops below eps times that of the first one, and returns their
+// number. A warm start passes in the *delta0 of the cold solve it continues,
+// since its own first sweep barely moves and would make the rule unreachable.
+// *delta is set to the decrease of the last sweep.
+template <typename F>
+int mix_sweeps(int max_iter, float eps, float *delta0, float *delta, F sweep) {
+  float tol = *delta0 * eps;
   int iter = 0;
-  // this is the outer loop in algo2 line4
+  *delta = 0;
   for (; iter < max_iter; iter++) {
-    delta =
-        mix_kernel(1, 0, m, k, index, S, NULL, V, NULL, W, gnrm, Snrms, cache);
-    if (iter && delta < eps)
+    *delta = sweep();
+    if (iter && *delta < tol)
       break;
-    if (iter == 0)
-      eps = delta * eps;
+    if (iter == 0 && *delta0 <= 0) {
+      *delta0 = *delta;
+      tol = *delta * eps;
+    }
   }
+  return iter;
+}
 
-  *niter = iter;
+// Sweeps of the backward pass for U: as many as the forward pass took
+// (niter) if eps <= 0, otherwise until |U^new-U^old|^2 of a sweep drops to
+// eps times that of the first one, at most max_iter. A first sweep that
+// leaves U unmoved (a zero dz, e.g. a padded sample) stops at once. Returns
+// their number, counted like niter in mix_sweeps.
+template <typename F>
+int mix_backward_sweeps(int max_iter, float eps, int niter, F sweep) {
+  if (eps <= 0) {
+    for (int iter = 0; iter < niter; iter++)
+      sweep();
+    return niter;
+  }
+  float tol = 0;
+  int iter = 0;
+  for (; iter < max_iter; iter++) {
+    float delta = sweep();
+    if (iter == 0)
+      tol = delta * eps;
+    if ((iter || delta <= 0) && delta <= tol)
+      break;
+  }
+  return iter;
+}
 
-  // because v_true is set to [1,0,0], dot(vo,v_true)=vo[0] therefore eq.7 can
-  // be computed as: 1 - acosf(vo[0]) / M_PI, notice acos(-z)/pi == 1-acos(z)/pi
-  // saturate is just to map anything into [0,1] for probabilistic output
+// because v_true is set to [1,0,0], dot(vo,v_true)=vo[0] therefore eq.7 can
+// be computed as: 1 - acosf(vo[0]) / M_PI, notice acos(-z)/pi == 1-acos(z)/pi
+// saturate is just to map anything into [0,1] for probabilistic output
+void mix_output_z(int k, const int32_t *index, const float *V, float *z) {
   for (int i, i_ = 0; (i = index[i_]); i_++) {
     float zi = V[i * k];
     zi = saturate((zi + 1) / 2) * 2 - 1;
@@ -211,12 +469,49 @@ void mix_forward(int max_iter, float eps, int n, int m, int k,
   }
 }
 
-void mix_backward(float prox_lam, int n, int m, int k, int32_t *is_input,
-                  int32_t *index, int32_t *niter, const float *S, float *dS,
-                  float *z, float *dz, const float *V, float *U, float *W,
-                  float *Phi, float *gnrm, float *Snrms, float *cache) {
+// consider the \min unsat problem,
+template <int K, typename T>
+void mix_forward(int max_iter, float eps, int n, int m, int k,
+                 const int32_t *index, int32_t *niter, float *delta0,
+                 float *delta, const T *S, float *z, float *V, float *W,
+                 float *gnrm, float *Snrms, float *cache, float *scratch,
+                 int team) {
+  if (team > 1) {
+    float *g = (float *)malloc(2 * (size_t)k * sizeof(float));
+    float *tdelta = (float *)malloc((size_t)team * sizeof(float));
+    const float delta_0 = *delta0;
+#pragma omp parallel num_threads(team)
+    {
+      mix_team_t t = mix_team_begin(m, k, g, tdelta);
+      float d0 = delta_0, d;
+      int iter = mix_sweeps(max_iter, eps, &d0, &d, [&] {
+        return mix_kernel_team<K>(t, 1, 0, m, k, index, S, NULL, V, NULL, W,
+                                  gnrm, Snrms);
+      });
+      if (t.rank == 0)
+        *niter = iter, *delta0 = d0, *delta = d;
+      mix_team_end(t);
+    }
+    free(g);
+    free(tdelta);
+  } else {
+    const int mb = mix_tile_cols(m, k);
+    float *Wt = mb < m ? scratch + 2 * (k + m) : W;
+    if (Wt != W)
+      mix_tile(m, k, mb, W, Wt);
+    *niter = mix_sweeps(max_iter, eps, delta0, delta, [&] {
+      return mix_kernel<K>(1, 0, m, k, mb, index, S, NULL, V, NULL, Wt, gnrm,
+                           Snrms, cache, scratch);
+    });
+    if (Wt != W)
+      mix_untile(m, k, mb, Wt, W);
+  }
+  mix_output_z(k, index, V, z);
+}
 
-  // eq.8 to get dvo
+// eq.8 to get dvo. Returns whether the gradient of the instance is invalid.
+int mix_backward_dv(const int32_t *index, const float *z, float *dz,
+                    const float *gnrm) {
   int invalid_flag = 0;
   for (int i, i_ = 0; (i = index[i_]); i_++) {
     float zi = z[i];
@@ -225,75 +520,544 @@ void mix_backward(float prox_lam, int n, int m, int k, int32_t *is_input,
       invalid_flag = 1;
     dz[i] = dzi;
   }
-  if (invalid_flag) {
-    szero(dz, n);
+  return invalid_flag;
+}
+
+// sanity check of the solution U
+int mix_backward_invalid(int n, int k, const float *U) {
+  int invalid_flag = 0;
+  for (int ik = 0; ik < n * k; ik++) {
+    if (isnan(U[ik]) || isinf(U[ik]))
+      invalid_flag = 1;
+  }
+  return invalid_flag;
+}
+
+// drops an instance with an invalid gradient from dz and dS, recording why
+// (MIX_INVALID_DZ or MIX_INVALID_U) in *invalid
+void mix_backward_drop(int n, int m, int k, float *dz, float *U, float *Phi,
+                       int32_t *invalid, int why) {
+  *invalid = why;
+  szero(dz, n);
+  szero(U, n * k);
+  szero(Phi, k * m);
+}
+
+// eq.10,12, 13, dzi = v0'Phi si, where phi01(i, val1, val2) returns the first
+// two entries of Phi si
+template <typename F>
+void mix_backward_dz(int n, int k, const int32_t *is_input, const float *z,
+                     const float *V, float *dz, F phi01) {
+  for (int i = 1; i < n; i++) {
+    if (!is_input[i]) {
+      dz[i] = 0;
+      continue;
+    }
+    float val1, val2;
+    phi01(i, val1, val2);
+    dz[i] = (dz[i] + val1) * sin(z[i] * M_PI) * M_PI +
+            val2 * copysign(cos(z[i] * M_PI) * M_PI, V[i * k + 1]) * M_PI;
+  }
+}
+
+// The per-instance parts of the backward pass: solves for U and Phi and
+// finishes dz. dS = sum_b U_b W_b + V_b Phi_b is reduced over the whole batch
+// afterwards by mix_dS; an instance whose gradient is invalid zeroes its U and
+// Phi so that it drops out of that sum.
+template <int K, typename T>
+void mix_backward(float prox_lam, int max_iter, float eps, int n, int m,
+                  int k, int32_t *is_input, int32_t *index, int32_t *niter,
+                  int32_t *bw_niter, int32_t *invalid,
+                  const T *S, float *z, float *dz, const float *V, float *U,
+                  float *W, float *Phi, float *gnrm, float *Snrms,
+                  float *cache, float *scratch, int team) {
+  *invalid = MIX_VALID;
+  *bw_niter = 0;
+  if (mix_backward_dv(index, z, dz, gnrm)) {
+    mix_backward_drop(n, m, k, dz, U, Phi, invalid, MIX_INVALID_DZ);
     return;
   }
 
   // eq.9, solve P (S'S+D_z-D_sii)xI_k P U = -dz P v0 approximately
-  for (int iter = 0; iter < *niter; iter++) {
-    mix_kernel(0, prox_lam, m, k, index, S, dz, U, V, Phi, gnrm, Snrms, cache);
+  if (team > 1) {
+    float *g = (float *)malloc(2 * (size_t)k * sizeof(float));
+    float *tdelta = (float *)malloc((size_t)team * sizeof(float));
+#pragma omp parallel num_threads(team)
+    {
+      mix_team_t t = mix_team_begin(m, k, g, tdelta);
+      int iter = mix_backward_sweeps(max_iter, eps, *niter, [&] {
+        return mix_kernel_team<K>(t, 0, prox_lam, m, k, index, S, dz, U, V,
+                                  Phi, gnrm, Snrms);
+      });
+      if (t.rank == 0)
+        *bw_niter = iter;
+      mix_team_end(t);
+    }
+    free(g);
+    free(tdelta);
+  } else {
+    const int mb = mix_tile_cols(m, k);
+    float *Phit = mb < m ? scratch + 2 * (k + m) : Phi;
+    if (Phit != Phi)
+      mix_tile(m, k, mb, Phi, Phit);
+    *bw_niter = mix_backward_sweeps(max_iter, eps, *niter, [&] {
+      return mix_kernel<K>(0, prox_lam, m, k, mb, index, S, dz, U, V, Phit,
+                           gnrm, Snrms, cache, scratch);
+    });
+    if (Phit != Phi)
+      mix_untile(m, k, mb, Phit, Phi);
   }
 
-  // sanity check
-  for (int ik = 0; ik < n * k; ik++) {
-    if (isnan(U[ik]) || isinf(U[ik]))
-      invalid_flag = 1;
+  if (mix_backward_invalid(n, k, U)) {
+    mix_backward_drop(n, m, k, dz, U, Phi, invalid, MIX_INVALID_U);
+    return;
+  }
+
+  mix_backward_dz(n, k, is_input, z, V, dz,
+                  [&](int i, float &val1, float &val2) {
+                    // both rows of Phi in one pass over Si
+                    const float *Si = srow(S + i * m, scratch, m);
+                    float val[2];
+                    sdotk(Si, Phi, m, 2, val);
+                    val1 = val[0], val2 = val[1];
+                  });
+}
+
+// Sparse S in CSR form: the nonzeros of row i are val[p] at the columns
+// col[p] for row[i] <= p < row[i+1]. W and Phi are then stored transposed,
+// m x k, so that the k-vector of a clause is contiguous and a coordinate
+// update costs O(nnz(Si) k) instead of O(m k).
+template <int K>
+float mix_kernel_sparse(int is_forward, float prox_lam, int k_,
+                        const int32_t *__restrict__ index,
+                        const int32_t *__restrict__ row,
+                        const int32_t *__restrict__ col,
+                        const float *__restrict__ val,
+                        const float *__restrict__ dz, float *__restrict__ V,
+                        const float *__restrict__ Vproj,
+                        float *__restrict__ Wt, float *__restrict__ gnrm,
+                        const float *__restrict__ Snrms,
+                        float *__restrict__ g) {
+  const int k = K ? K : k_;
+  float delta = 0;
+  for (int i, i_ = 0; (i = index[i_]); i_++) {
+    const int p0 = row[i], p1 = row[i + 1];
+
+    // g = W Si - Sii vi over the nonzeros of Si only
+    for (int kk = 0; kk < k; kk++)
+      g[kk] = -Snrms[i] * V[i * k + kk];
+    for (int p = p0; p < p1; p++)
+      kaxpy(g, val[p], Wt + col[p] * k, k);
+
+    const float gnrmi =
+        mix_update_v<K>(is_forward, prox_lam, k, i, dz, V, Vproj, gnrm, g);
+    // W += (vi^new-vi^old) Si'
+    for (int p = p0; p < p1; p++)
+      kaxpy(Wt + col[p] * k, val[p], g, k);
+
+    delta += (is_forward ? gnrmi : 1) * kdot(g, g, k);
+    if (is_forward)
+      gnrm[i] = gnrmi;
   }
-  if (invalid_flag) {
-    szero(dz, n);
+  return delta;
+}
+
+template <int K>
+void mix_forward_sparse(int max_iter, float eps, int k, const int32_t *index,
+                        int32_t *niter, float *delta0, float *delta,
+                        const int32_t *row, const int32_t *col,
+                        const float *val, float *z, float *V, float *Wt,
+                        float *gnrm, float *Snrms, float *cache) {
+  *niter = mix_sweeps(max_iter, eps, delta0, delta, [&] {
+    return mix_kernel_sparse<K>(1, 0, k, index, row, col, val, NULL, V, NULL,
+                                Wt, gnrm, Snrms, cache);
+  });
+  mix_output_z(k, index, V, z);
+}
+
+template <int K>
+void mix_backward_sparse(float prox_lam, int max_iter, float eps, int n,
+                         int m, int k, int32_t *is_input, int32_t *index,
+                         int32_t *niter, int32_t *bw_niter,
+                         int32_t *invalid, const int32_t *row,
+                         const int32_t *col, const float *val, float *z,
+                         float *dz, const float *V, float *U, float *Phit,
+                         float *gnrm, float *Snrms, float *cache) {
+  *invalid = MIX_VALID;
+  *bw_niter = 0;
+  if (mix_backward_dv(index, z, dz, gnrm)) {
+    mix_backward_drop(n, m, k, dz, U, Phit, invalid, MIX_INVALID_DZ);
+    return;
+  }
+
+  *bw_niter = mix_backward_sweeps(max_iter, eps, *niter, [&] {
+    return mix_kernel_sparse<K>(0, prox_lam, k, index, row, col, val, dz, U,
+                                V, Phit, gnrm, Snrms, cache);
+  });
+
+  if (mix_backward_invalid(n, k, U)) {
+    mix_backward_drop(n, m, k, dz, U, Phit, invalid, MIX_INVALID_U);
     return;
   }
 
-  // eq.11, dS = U W + V Phi
-  // dS: nxm, U: nxk, W: kxm
+  mix_backward_dz(n, k, is_input, z, V, dz,
+                  [&](int i, float &val1, float &val2) {
+                    val1 = val2 = 0;
+                    for (int p = row[i]; p < row[i + 1]; p++) {
+                      val1 += val[p] * Phit[col[p] * k + 0];
+                      val2 += val[p] * Phit[col[p] * k + 1];
+                    }
+                  });
+}
+
+// W = V'S, i.e. W accumulates vi Si' over all variables (algo2 line3). The
+// truth vector and the inputs are fixed in span(e0, e1) by mix_init, so
+// their term of W only has the rows 0 and 1, and only the outputs add to all
+// k rows.
+template <typename T>
+void mix_init_W(int n, int m, int k, const int32_t *is_input, const T *S,
+                const float *V, float *W, float *Sbuf) {
+  szero(W, k * m);
   for (int i = 0; i < n; i++) {
-    for (int kk = 0; kk < k; kk++) {
-      saxpy(dS + i * m, U[i * k + kk], W + kk * m, m);
-      saxpy(dS + i * m, V[i * k + kk], Phi + kk * m, m);
+    const float *Si = srow(S + i * m, Sbuf, m);
+    const int rows = is_input[i] ? 2 : k;
+    for (int kk = 0; kk < rows; kk++)
+      saxpy(W + kk * m, V[i * k + kk], Si, m);
+  }
+}
+
+template <typename T>
+void mix_init_launcher(mix_t mix, int32_t *perm, int perm_stride) {
+  int n = mix.n, m = mix.m, k = mix.k;
+  const T *S = (const T *)mix.S;
+#pragma omp parallel
+  {
+    float *Sbuf = (float *)malloc((size_t)m * sizeof(float));
+
+    // Snrms = diag(S S'), used in algo2 line6
+#pragma omp for
+    for (int i = 0; i < n; i++) {
+      const float *Si = srow(S + i * m, Sbuf, m);
+      mix.Snrms[i] = sdot(Si, Si, m);
+    }
+
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < mix.b; i++) {
+      mix_init(perm + i * perm_stride, mix.n, mix.k, mix.is_input + i * n, mix.index + i * n,
+               mix.z + i * n, mix.V + i * n * k);
+      mix_init_W(n, m, k, mix.is_input + i * n, S, mix.V + i * n * k,
+                 mix.W + i * m * k, Sbuf);
     }
+    free(Sbuf);
   }
-  // eq.10,12, 13, dzi = v0'Phi si
-  for (int i = 1; i < n; i++) {
-    if (!is_input[i]) {
-      dz[i] = 0;
-      continue;
+}
+
+void mix_init_launcher_cpu(mix_t mix, int32_t *perm, int perm_stride) {
+  MIX_SWITCH_T(mix.dtype, mix_init_launcher<T>(mix, perm, perm_stride));
+}
+
+// mix_init for a converged (V, W) whose inputs changed where changed[i] is
+// set: the rows of those variables are set again as in mix_init, and the
+// difference goes into W = V'S as one rank-1 update per row, O(m k) each
+// instead of the O(n m k) rebuild. index is drawn again from perm.
+template <typename T>
+void mix_update_launcher(mix_t mix, int32_t *perm, int perm_stride,
+                         const int32_t *changed) {
+  int n = mix.n, m = mix.m, k = mix.k;
+  const T *S = (const T *)mix.S;
+#pragma omp parallel
+  {
+    float *Sbuf = (float *)malloc((size_t)m * sizeof(float));
+#pragma omp for schedule(dynamic)
+    for (int b = 0; b < mix.b; b++) {
+      const int32_t *is_input = mix.is_input + b * n;
+      float *V = mix.V + b * n * k, *W = mix.W + b * m * k;
+      float *dv = mix.cache + b * k;
+      for (int i = 1; i < n; i++) {
+        if (!changed[b * n + i])
+          continue;
+        scopy(V + i * k, dv, k);
+        mix_init_v(i, k, is_input, mix.z + b * n, V);
+        kscal(dv, -1, k);
+        kaxpy(dv, 1, V + i * k, k);
+        const float *Si = srow(S + i * m, Sbuf, m);
+        for (int kk = 0; kk < k; kk++)
+          saxpy(W + kk * m, dv[kk], Si, m);
+      }
+      mix_init_index(perm + b * perm_stride, n, is_input, mix.index + b * n);
     }
-    float val1 = sdot(S + i * m, Phi + 0 * m, m),
-          val2 = sdot(S + i * m, Phi + 1 * m, m);
-    dz[i] = (dz[i] + val1) * sin(z[i] * M_PI) * M_PI +
-            val2 * copysign(cos(z[i] * M_PI) * M_PI, V[i * k + 1]) * M_PI;
+    free(Sbuf);
   }
 }
 
-void mix_init_launcher_cpu(mix_t mix, int32_t *perm) {
-  int n = mix.n, k = mix.k;
-#pragma omp parallel for schedule(dynamic)
-  for (int i = 0; i < mix.b; i++) {
-    mix_init(perm, mix.n, mix.k, mix.is_input + i * n, mix.index + i * n,
-             mix.z + i * n, mix.V + i * n * k);
+void mix_update_launcher_cpu(mix_t mix, int32_t *perm, int perm_stride,
+                             const int32_t *changed) {
+  MIX_SWITCH_T(mix.dtype,
+               mix_update_launcher<T>(mix, perm, perm_stride, changed));
+}
+
+// Threads per instance. Batches at least as large as the thread count are
+// only parallelized over the instances. Smaller ones (down to inference at
+// b = 1) split the rows of W of every instance over a team of threads, as
+// long as each thread keeps at least TEAM_MIN_FLOATS of W to update.
+int mix_team_size(mix_t mix) {
+  const int nt = omp_get_max_threads();
+  if (mix.b >= nt)
+    return 1;
+  int team = nt / mix.b;
+  const int most = mix.k * mix.m / TEAM_MIN_FLOATS;
+  if (team > most)
+    team = most;
+  if (team > mix.k)
+    team = mix.k;
+  return team < 1 ? 1 : team;
+}
+
+// With team > 1 the batch is shared out over b outer threads, and each of
+// them forks its own team per instance. This needs nested parallelism for
+// the duration of the launch.
+struct mix_nested_t {
+  int levels;
+  mix_nested_t(int team) : levels(omp_get_max_active_levels()) {
+    if (team > 1 && levels < 2)
+      omp_set_max_active_levels(2);
+  }
+  ~mix_nested_t() { omp_set_max_active_levels(levels); }
+};
+
+// Every thread gets the scratch of mix_scratch_floats.
+template <int K, typename T>
+void mix_forward_launcher(mix_t mix, int max_iter, float eps) {
+  int n = mix.n, m = mix.m, k = mix.k;
+  const int team = mix_team_size(mix);
+  mix_nested_t nested(team);
+  const int nouter = team == 1 ? omp_get_max_threads() : mix.b;
+#pragma omp parallel num_threads(nouter)
+  {
+    float *scratch = (float *)malloc(mix_scratch_floats(m, k) * sizeof(float));
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < mix.b; i++) {
+      mix_forward<K>(max_iter, eps, mix.n, mix.m, mix.k, mix.index + i * n,
+                     mix.niter + i, mix.delta0 + i, mix.delta + i,
+                     (const T *)mix.S,
+                     mix.z + i * n, mix.V + i * n * k, mix.W + i * m * k,
+                     mix.gnrm + i * n, mix.Snrms, mix.cache + i * k, scratch,
+                     team);
+    }
+    free(scratch);
+  }
+}
+
+// Init and forward of one instance of a grouped solve, single-threaded
+template <int K, typename T>
+void mix_group_instance(const mix_group_t &g, int i, float *scratch) {
+  const mix_t &mix = g.mix;
+  int n = mix.n, m = mix.m, k = mix.k;
+  float *V = mix.V + i * n * k, *W = mix.W + i * m * k;
+  mix_init(g.perm + i * g.perm_stride, n, k, mix.is_input + i * n,
+           mix.index + i * n, mix.z + i * n, V);
+  mix_init_W(n, m, k, mix.is_input + i * n, (const T *)mix.S, V, W, scratch);
+  mix_forward<K>(g.max_iter, g.eps, n, m, k, mix.index + i * n,
+                 mix.niter + i, mix.delta0 + i, mix.delta + i,
+                 (const T *)mix.S, mix.z + i * n, V, W, mix.gnrm + i * n,
+                 mix.Snrms, mix.cache + i * k, scratch, 1);
+}
+
+// Several problems of different S, sizes and batches solved in one parallel
+// region: the Snrms of all of them, then init and forward of all their
+// instances from one dynamic work list, so that small problems fill the
+// threads together instead of one after the other.
+void mix_solve_grouped_launcher_cpu(mix_group_t *group, int ngroup) {
+  size_t floats = 0;
+  int total = 0;
+  for (int p = 0; p < ngroup; p++) {
+    const mix_t &mix = group[p].mix;
+    const size_t f = mix_scratch_floats(mix.m, mix.k);
+    floats = f > floats ? f : floats;
+    group[p].first = total;
+    total += mix.b;
+  }
+#pragma omp parallel
+  {
+    float *scratch = (float *)malloc(floats * sizeof(float));
+    for (int p = 0; p < ngroup; p++) {
+      const mix_t &mix = group[p].mix;
+#pragma omp for nowait
+      for (int i = 0; i < mix.n; i++) {
+        MIX_SWITCH_T(mix.dtype,
+            const float *Si = srow((const T *)mix.S + i * mix.m, scratch, mix.m);
+            mix.Snrms[i] = sdot(Si, Si, mix.m));
+      }
+    }
+#pragma omp barrier
+
+#pragma omp for schedule(dynamic)
+    for (int q = 0; q < total; q++) {
+      int p = 0;
+      while (p + 1 < ngroup && group[p + 1].first <= q)
+        p++;
+      const mix_group_t &g = group[p];
+      MIX_SWITCH_T(g.mix.dtype, MIX_SWITCH_K(g.mix.k,
+          mix_group_instance<K, T>(g, q - g.first, scratch)));
+    }
+    free(scratch);
+  }
+}
+
+// eq.11 summed over the batch, dS = sum_b U_b W_b + V_b Phi_b
+// dS: nxm, U_b: nxk, W_b: kxm
+// This is a GEMM with inner dimension b*k. dS is cut into MB x NB tiles that
+// stay in L1 while every (b, kk) row of W and Phi is streamed through them,
+// so each tile is owned by one thread and needs no atomics.
+void mix_dS(mix_t mix) {
+  const int MB = 16, NB = 256;
+  int n = mix.n, m = mix.m, k = mix.k;
+  int nrow = (n + MB - 1) / MB, ncol = (m + NB - 1) / NB;
+#pragma omp parallel for collapse(2) schedule(dynamic)
+  for (int ib = 0; ib < nrow; ib++) {
+    for (int jb = 0; jb < ncol; jb++) {
+      int i0 = ib * MB, i1 = i0 + MB < n ? i0 + MB : n;
+      int j0 = jb * NB, nb = j0 + NB < m ? NB : m - j0;
+      for (int i = i0; i < i1; i++)
+        szero(mix.dS + i * m + j0, nb);
+      for (int b = 0; b < mix.b; b++) {
+        const float *U = mix.U + b * n * k, *V = mix.V + b * n * k;
+        const float *W = mix.W + b * m * k, *Phi = mix.Phi + b * m * k;
+        for (int i = i0; i < i1; i++) {
+          for (int kk = 0; kk < k; kk++) {
+            saxpy(mix.dS + i * m + j0, U[i * k + kk], W + kk * m + j0, nb);
+            saxpy(mix.dS + i * m + j0, V[i * k + kk], Phi + kk * m + j0, nb);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <int K, typename T>
+void mix_backward_launcher(mix_t mix, float prox_lam, int max_iter,
+                           float eps) {
+  int n = mix.n, m = mix.m, k = mix.k;
+  const int team = mix_team_size(mix);
+  mix_nested_t nested(team);
+  const int nouter = team == 1 ? omp_get_max_threads() : mix.b;
+#pragma omp parallel num_threads(nouter)
+  {
+    float *scratch = (float *)malloc(mix_scratch_floats(m, k) * sizeof(float));
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < mix.b; i++) {
+      mix_backward<K>(prox_lam, max_iter, eps, mix.n, mix.m, mix.k,
+                      mix.is_input + i * n, mix.index + i * n, mix.niter + i,
+                      mix.bw_niter + i, mix.invalid + i,
+                      (const T *)mix.S,
+                      mix.z + i * n, mix.dz + i * n, mix.V + i * n * k,
+                      mix.U + i * n * k, mix.W + i * m * k,
+                      mix.Phi + i * m * k, mix.gnrm + i * n, mix.Snrms,
+                      mix.cache + i * k, scratch, team);
+    }
+    free(scratch);
   }
 }
 
 void mix_forward_launcher_cpu(mix_t mix, int max_iter, float eps) {
+  MIX_SWITCH_T(mix.dtype,
+      MIX_SWITCH_K(mix.k, mix_forward_launcher<K, T>(mix, max_iter, eps)));
+}
+
+// The CPU dS reduction always runs in FP32, math is ignored.
+void mix_backward_launcher_cpu(mix_t mix, float prox_lam, int max_iter,
+                               float eps, int math) {
+  MIX_SWITCH_T(mix.dtype, MIX_SWITCH_K(mix.k,
+      mix_backward_launcher<K, T>(mix, prox_lam, max_iter, eps)));
+  mix_dS(mix);
+}
+
+// Sparse S, see mix_kernel_sparse: mix.S holds the nnz values of the CSR
+// pattern mix.Srow/mix.Scol and mix.dS their gradients, W and Phi are m x k.
+// Always FP32, and one thread per instance: a coordinate touches too little
+// of W to split over a team.
+void mix_init_sparse_launcher_cpu(mix_t mix, int32_t *perm, int perm_stride) {
   int n = mix.n, m = mix.m, k = mix.k;
+  const int32_t *row = mix.Srow, *col = mix.Scol;
+  const float *val = (const float *)mix.S;
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    float s = 0;
+    for (int p = row[i]; p < row[i + 1]; p++)
+      s += val[p] * val[p];
+    mix.Snrms[i] = s;
+  }
+
 #pragma omp parallel for schedule(dynamic)
-  for (int i = 0; i < mix.b; i++) {
-    mix_forward(max_iter, eps, mix.n, mix.m, mix.k, mix.index + i * n,
-                mix.niter + i, mix.S, mix.z + i * n, mix.V + i * n * k,
-                mix.W + i * m * k, mix.gnrm + i * n, mix.Snrms,
-                mix.cache + i * k);
+  for (int b = 0; b < mix.b; b++) {
+    const float *V = mix.V + b * n * k;
+    float *Wt = mix.W + b * m * k;
+    mix_init(perm + b * perm_stride, n, k, mix.is_input + b * n,
+             mix.index + b * n, mix.z + b * n, mix.V + b * n * k);
+    szero(Wt, m * k);
+    for (int i = 0; i < n; i++) {
+      for (int p = row[i]; p < row[i + 1]; p++)
+        kaxpy(Wt + col[p] * k, val[p], V + i * k, k);
+    }
   }
 }
 
-void mix_backward_launcher_cpu(mix_t mix, float prox_lam) {
+template <int K>
+void mix_forward_sparse_launcher(mix_t mix, int max_iter, float eps) {
   int n = mix.n, m = mix.m, k = mix.k;
 #pragma omp parallel for schedule(dynamic)
-  for (int i = 0; i < mix.b; i++) {
-    mix_backward(prox_lam, mix.n, mix.m, mix.k, mix.is_input + i * n,
-                 mix.index + i * n, mix.niter + i, mix.S, mix.dS + i * n * m,
-                 mix.z + i * n, mix.dz + i * n, mix.V + i * n * k,
-                 mix.U + i * n * k, mix.W + i * m * k, mix.Phi + i * m * k,
-                 mix.gnrm + i * n, mix.Snrms, mix.cache + i * k);
+  for (int b = 0; b < mix.b; b++) {
+    mix_forward_sparse<K>(max_iter, eps, k, mix.index + b * n, mix.niter + b,
+                          mix.delta0 + b, mix.delta + b, mix.Srow, mix.Scol,
+                          (const float *)mix.S, mix.z + b * n,
+                          mix.V + b * n * k, mix.W + b * m * k,
+                          mix.gnrm + b * n, mix.Snrms, mix.cache + b * k);
   }
 }
+
+// eq.11 restricted to the pattern of S (an SDDMM),
+// dS[p] = sum_b U_b[i]'W_b[col[p]] + V_b[i]'Phi_b[col[p]] for p in row i
+void mix_dS_sparse(mix_t mix) {
+  int n = mix.n, m = mix.m, k = mix.k;
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int i = 0; i < n; i++) {
+    for (int p = mix.Srow[i]; p < mix.Srow[i + 1]; p++) {
+      const int j = mix.Scol[p];
+      float s = 0;
+      for (int b = 0; b < mix.b; b++) {
+        s += kdot(mix.U + (b * n + i) * k, mix.W + (b * m + j) * k, k);
+        s += kdot(mix.V + (b * n + i) * k, mix.Phi + (b * m + j) * k, k);
+      }
+      mix.dS[p] = s;
+    }
+  }
+}
+
+template <int K>
+void mix_backward_sparse_launcher(mix_t mix, float prox_lam, int max_iter,
+                                  float eps) {
+  int n = mix.n, m = mix.m, k = mix.k;
+#pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < mix.b; b++) {
+    mix_backward_sparse<K>(prox_lam, max_iter, eps, n, m, k,
+                           mix.is_input + b * n, mix.index + b * n,
+                           mix.niter + b, mix.bw_niter + b,
+                           mix.invalid + b, mix.Srow,
+                           mix.Scol, (const float *)mix.S, mix.z + b * n,
+                           mix.dz + b * n, mix.V + b * n * k,
+                           mix.U + b * n * k, mix.Phi + b * m * k,
+                           mix.gnrm + b * n, mix.Snrms, mix.cache + b * k);
+  }
+}
+
+void mix_forward_sparse_launcher_cpu(mix_t mix, int max_iter, float eps) {
+  MIX_SWITCH_K(mix.k, mix_forward_sparse_launcher<K>(mix, max_iter, eps));
+}
+
+void mix_backward_sparse_launcher_cpu(mix_t mix, float prox_lam, int max_iter,
+                                      float eps) {
+  MIX_SWITCH_K(mix.k,
+      mix_backward_sparse_launcher<K>(mix, prox_lam, max_iter, eps));
+  mix_dS_sparse(mix);
+}
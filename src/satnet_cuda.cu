@@ -3,25 +3,55 @@
 //#include <assert.h>
 #include <stdint.h>
 #include <float.h>
+#include <algorithm>
 
 #include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
+#include <cuda_pipeline.h>
+#include <cublas_v2.h>
+#include <ATen/cuda/CUDAContext.h>
 #include "satnet.h"
 
 const double MEPS = 1e-24;
 const int WARP_SIZE = 32;
 const int WARP_NUM = 32;
-const int MBUF_SIZE = 320;
+const int SMEM_DEFAULT = 48*1024;        // dynamic smem bytes without opt-in
+
+// Small problems run one instance per warp instead of one per block, see
+// mix_warp_instances for the selection rule.
+const int WARP_MODE_MAX_FLOATS = 3072;    // smem floats per instance, (k+1)*m
+const int WARP_MODE_SMEM = SMEM_DEFAULT;   // smem bytes per block
+const int WARP_MODE_MAX_WARPS = 8;        // instances per block
+const int SPARSE_WARPS = 8;               // instances per block with sparse S
+
+// S is stored as T = float, __half or __nv_bfloat16 (see MIX_FP32) and
+// widened on load; shared memory, W, Phi and all arithmetic stay FP32. The
+// explicit intrinsics are needed since torch builds with
+// __CUDA_NO_HALF_CONVERSIONS__.
+__device__ __forceinline__ float to_f(float x) { return x; }
+__device__ __forceinline__ float to_f(__half x) { return __half2float(x); }
+__device__ __forceinline__ float to_f(__nv_bfloat16 x) { return __bfloat162float(x); }
+
+// Runs the statement in __VA_ARGS__ with T the CUDA type of S
+#define MIX_SWITCH_T(dtype, ...) \
+    switch (dtype) { \
+        case MIX_FP16: { typedef __half T;        __VA_ARGS__; } break; \
+        case MIX_BF16: { typedef __nv_bfloat16 T; __VA_ARGS__; } break; \
+        default:       { typedef float T;         __VA_ARGS__; } break; \
+    }
 
 // Warp level dot product
+template <typename TX, typename TZ>
 __device__
-float warpdot(const float * x, const float * z, int k)
+float warpdot(const TX * x, const TZ * z, int k)
 {
     if (k==0) return 0;
     int lane = threadIdx.x % WARP_SIZE;
 
     float val = 0;
     #pragma unroll 2
-    for (int i=lane; i<k; i+=WARP_SIZE) val += x[i]*z[i];
+    for (int i=lane; i<k; i+=WARP_SIZE) val += to_f(x[i])*to_f(z[i]);
     __syncwarp();
 
     unsigned int active = __activemask();
@@ -32,133 +62,378 @@ float warpdot(const float * x, const float * z, int k)
     return val;
 }
 
-__global__ void mix_init(int32_t *perm, int n, int k, const int32_t *is_input, int32_t *index, const float *z, float *V)
+// Warp level sum of one value per lane, all lanes must participate
+__device__ __forceinline__
+float warpsum(float val)
 {
+    #pragma unroll
+    for (int off=WARP_SIZE/2; off; off/=2) 
+        val += __shfl_xor_sync(0xffffffff, val, off);
+    return val;
+}
+
+// The part of mix_init for vi, by one warp: set from zi for an input,
+// normalized otherwise
+__device__ __forceinline__
+void mix_init_v(int i, int k, const int32_t *is_input, const float *z, float *V)
+{
+    int lane = threadIdx.x % WARP_SIZE;
+    if (is_input[i]) {
+        for (int kk=lane; kk<k; kk+=WARP_SIZE) {
+            if (kk==0) V[i*k] = -cos(z[i]*M_PI);
+            else if (kk==1) V[i*k+1] = copysign(sin(z[i]*M_PI), V[i*k+1]);
+            else V[i*k+kk] = 0;
+        }
+        __syncwarp();
+    } else {
+        float s = warpdot(V+i*k, V+i*k, k);
+        s = rsqrtf(s);
+        __syncwarp();
+        for (int kk=lane; kk<k; kk+=WARP_SIZE) V[i*k+kk] *= s;
+    }
+}
+
+// index = the output variables in the order of perm, zero-terminated.
+// A block-wide stream compaction over chunks of blockDim.x variables: the
+// slot of an output variable is the number of output variables before it,
+// from a ballot within the warp and the warp totals in shared memory.
+__device__ __forceinline__
+void mix_init_index(const int32_t *perm, int n, const int32_t *is_input, int32_t *index)
+{
+    __shared__ int wsum[WARP_NUM];
+    const int warp = threadIdx.x / WARP_SIZE;
+    const int lane = threadIdx.x % WARP_SIZE;
+    const int nwarp = blockDim.x / WARP_SIZE;
+    int base = 0;
+    for (int c=0; c<n-1; c+=blockDim.x) {
+        const int i_ = c+threadIdx.x;
+        const int i = i_ < n-1 ? perm[i_]+1 : 0;
+        const bool out = i && !is_input[i];
+        const unsigned ballot = __ballot_sync(0xffffffff, out);
+        if (lane == 0) wsum[warp] = __popc(ballot);
+        __syncthreads();
+        int before = __popc(ballot & ((1u << lane) - 1)), total = 0;
+        for (int w=0; w<nwarp; w++) {
+            if (w < warp) before += wsum[w];
+            total += wsum[w];
+        }
+        if (out) index[base+before] = i;
+        base += total;
+        __syncthreads(); // wsum is reused by the next chunk
+    }
+    for (int j=base+threadIdx.x; j<n; j+=blockDim.x) index[j] = 0;
+    __syncthreads();
+}
+
+__global__ void mix_init(const int32_t *perm, int perm_stride, int n, int k, const int32_t *is_input, int32_t *index, const float *z, float *V)
+{
+    perm +=      perm_stride * blockIdx.x;
     z +=         n   * blockIdx.x;
     is_input += n   * blockIdx.x;
     V +=         n*k * blockIdx.x;
     index +=     n   * blockIdx.x;
 
     int warp = threadIdx.x / WARP_SIZE;
-    int lane = threadIdx.x % WARP_SIZE;
+    for (int i=warp; i<n; i+=WARP_NUM) mix_init_v(i, k, is_input, z, V);
+    mix_init_index(perm, n, is_input, index);
+    //__threadfence_system();
+}
+
+// mix_init for a converged (V, W) whose inputs changed where changed[i] is
+// set, one block per instance: warp 0 sets the row of such a variable again
+// and the block adds the difference to W = V'S as a rank-1 update, O(m k)
+// per row instead of the GEMM over all n. The rows are few, one after the
+// other, since they all update the whole of W.
+template <typename T>
+__global__ void mix_update(const int32_t *perm, int perm_stride, int n, int m, int k, const int32_t *changed, const int32_t *is_input, int32_t *index, const float *z, float *V, const T *S, float *W)
+{
+    perm +=      perm_stride * blockIdx.x;
+    changed +=   n   * blockIdx.x;
+    z +=         n   * blockIdx.x;
+    is_input += n   * blockIdx.x;
+    V +=         n*k * blockIdx.x;
+    W +=         m*k * blockIdx.x;
+    index +=     n   * blockIdx.x;
 
-    for (int i=warp; i<n; i+=WARP_NUM) {
-        if (is_input[i]) {
-            for (int kk=lane; kk<k; kk+=WARP_SIZE) {
-                if (kk==0) V[i*k] = -cos(z[i]*M_PI);
-                else if (kk==1) V[i*k+1] = copysign(sin(z[i]*M_PI), V[i*k+1]);
-                else V[i*k+kk] = 0;
-            }
+    extern __shared__ float dv[]; // k
+    const int lane = threadIdx.x % WARP_SIZE;
+    for (int i=1; i<n; i++) {
+        if (!changed[i]) continue;
+        if (threadIdx.x < WARP_SIZE) {
+            for (int kk=lane; kk<k; kk+=WARP_SIZE) dv[kk] = V[i*k+kk];
             __syncwarp();
-        } else {
-            float s = warpdot(V+i*k, V+i*k, k);
-            s = rsqrtf(s);
+            mix_init_v(i, k, is_input, z, V);
             __syncwarp();
-            for (int kk=lane; kk<k; kk+=WARP_SIZE) V[i*k+kk] *= s;
+            for (int kk=lane; kk<k; kk+=WARP_SIZE) dv[kk] = V[i*k+kk] - dv[kk];
         }
+        __syncthreads();
+        for (int l=threadIdx.x; l<k*m; l+=blockDim.x)
+            W[l] += dv[l/m] * to_f(S[i*m + l%m]);
+        __syncthreads(); // dv is reused by the next row
     }
-    if (threadIdx.x==0) {
-        int i_=0, j=0;
-        for (; i_<n-1; i_++) {
-            int i = perm[i_]+1;
-            //int i = i_+1;
-            if (!is_input[i]) index[j++] = i;
-        }
-        for (; j<n; j++) index[j] = 0;
+    mix_init_index(perm, n, is_input, index);
+}
+
+// Snrms = diag(S S'), one warp per row
+template <typename T>
+__global__ void mix_snrms(int n, int m, const T *S, float *Snrms)
+{
+    int i = blockIdx.x * (blockDim.x / WARP_SIZE) + threadIdx.x / WARP_SIZE;
+    if (i >= n) return;
+
+    float s = warpdot(S+i*m, S+i*m, m);
+    if (threadIdx.x % WARP_SIZE == 0) Snrms[i] = s;
+}
+
+// y = float(x), grid-stride over l elements
+template <typename T>
+__global__ void mix_widen(long long l, const T *x, float *y)
+{
+    for (long long i = blockIdx.x*(long long)blockDim.x + threadIdx.x; i < l; i += (long long)gridDim.x*blockDim.x)
+        y[i] = to_f(x[i]);
+}
+
+// number of WARP_NUM-warp blocks for a grid-stride loop over l elements
+static int mix_grid(long long l)
+{
+    return (int)std::min<long long>((l + WARP_SIZE*WARP_NUM-1) / (WARP_SIZE*WARP_NUM), 65535);
+}
+
+/*  The rows of S are read in the fixed order of index, so mix_kernel keeps
+ *  three of them in shared memory: the row of the current coordinate, the
+ *  next one (published by the barrier of the current coordinate) and the one
+ *  after, in flight. mix_row_issue starts a copy, as a cp.async on sm_80+
+ *  that completes in the background and synchronously on older parts; it
+ *  moves 4-byte units, so a 16-bit S needs an even m (otherwise
+ *  mix_row_complete loads the row directly). 16-bit rows land in a staging
+ *  buffer and are widened by mix_row_complete. Every thread issues, waits
+ *  for and widens the same units, so no barrier is needed between the steps.
+ */
+__host__ __device__ __forceinline__
+int mix_row_floats(int m, int elem_size)
+{
+    return 3*m + (elem_size == 4 ? 0 : (m+1)/2);
+}
+
+template <typename T>
+__device__ __forceinline__
+bool mix_row_async(int m)
+{
+    return sizeof(T) == sizeof(uint32_t) || m % 2 == 0;
+}
+
+template <typename T>
+__device__ __forceinline__
+void mix_row_issue(float *dst, T *raw, const T *Srow, int m)
+{
+    if (!mix_row_async<T>(m)) return;
+    uint32_t *to = (uint32_t *)(sizeof(T) == sizeof(float) ? (T *)dst : raw);
+    const int units = m*sizeof(T)/sizeof(uint32_t);
+    for (int u=threadIdx.x; u<units; u+=blockDim.x) {
+#if __CUDA_ARCH__ >= 800
+        __pipeline_memcpy_async(to + u, (const uint32_t *)Srow + u, sizeof(uint32_t));
+#else
+        to[u] = ((const uint32_t *)Srow)[u];
+#endif
+    }
+#if __CUDA_ARCH__ >= 800
+    __pipeline_commit();
+#endif
+}
+
+template <typename T>
+__device__ __forceinline__
+void mix_row_complete(float *dst, const T *raw, const T *Srow, int m)
+{
+    if (!mix_row_async<T>(m)) {
+        for (int j=threadIdx.x; j<m; j+=blockDim.x) dst[j] = to_f(Srow[j]);
+        return;
+    }
+#if __CUDA_ARCH__ >= 800
+    __pipeline_wait_prior(0);
+#endif
+    if (sizeof(T) != sizeof(float)) {
+        const int per = sizeof(uint32_t)/sizeof(T), units = m/per;
+        for (int u=threadIdx.x; u<units; u+=blockDim.x)
+            for (int e=0; e<per; e++) dst[u*per+e] = to_f(raw[u*per+e]);
     }
-    __syncthreads();
-    //__threadfence_system();
 }
 
 /*  The mix kernel perform a cycle of block coordinate descent for all Vi.
+ *
+ *  Each warp owns the rows kk = warp, warp+nwarp, ... of W (one row per warp
+ *  when k <= WARP_NUM), so a block has min(k, WARP_NUM) warps. K is the rank
+ *  when it is known at compile time and 0 otherwise.
+ *
+ *  A coordinate needs a single __syncthreads(). A warp computes its rows of
+ *  g, and after the barrier each warp sums the per-warp partials of |g|^2
+ *  (vi'g in the backward pass) for the step, then updates its own rows of vi
+ *  and W, which no other warp reads. So the barrier only has to publish the
+ *  partials and the next row of S. The partials alternate between two slots,
+ *  whose reuse two coordinates later is ordered by the barrier in between,
+ *  and the decrease of the sweep is summed per warp and reduced once at the
+ *  end.
  */
+template <int K, typename T>
 __forceinline__
 __device__ float mix_kernel(const int is_forward, float prox_lam,
-        int m, int k, const int32_t *__restrict__ index, 
-        const float *__restrict__ S, const float *__restrict__ dz, float *__restrict__ V, const float *__restrict__ Vproj, float *__restrict__ W, 
+        int m, int k_, int mbuf, const int32_t *__restrict__ index, 
+        const T *__restrict__ S, const float *__restrict__ dz, float *__restrict__ V, const float *__restrict__ Vproj, float *__restrict__ W, 
         float *__restrict__ gnrm, const float *__restrict__ Snrms, float *smem)
 {
-
-    const int kk = threadIdx.x / WARP_SIZE;
+    const int k = K ? K : k_;
+    const int nwarp = K ? (K < WARP_NUM ? K : WARP_NUM) : blockDim.x / WARP_SIZE;
+    const int warp = threadIdx.x / WARP_SIZE;
     const int lane = threadIdx.x % WARP_SIZE;
 
-    float * __restrict__ g =    smem;
-    float * __restrict__ Si =   smem+k;
-    float * __restrict__ Wbuf = smem+k+m; // smem buf for the first MBUF_SIZE W
+    float * __restrict__ g =    smem;       // each warp's own rows only
+    float * Sbuf =              smem+k;     // three rows of S, see mix_row_issue
+    T * raw =                   (T *)(smem+k+3*m);
+    float * __restrict__ Wbuf = smem+k+mix_row_floats(m, sizeof(T)); // smem buf for the first mbuf columns of W
+    __shared__ float part[2][WARP_NUM];
 
-    int mbuf = m>MBUF_SIZE ?   MBUF_SIZE : m; // mbuf = # of m inside buffer (in smem)
-    int mrem = m>MBUF_SIZE ? m-MBUF_SIZE : 0; // mrem = # of m outside buffer (in global mem)
-    for (int j=lane; j<mbuf; j+=WARP_SIZE) Wbuf[kk*mbuf+j] = W[kk*m+j];
+    int mrem = m-mbuf; // mrem = # of m outside buffer (in global mem)
+    for (int kk=warp; kk<k; kk+=nwarp)
+        for (int j=lane; j<mbuf; j+=WARP_SIZE) Wbuf[kk*mbuf+j] = W[kk*m+j];
 
-    __shared__ float delta;
-    if (threadIdx.x==0) delta = 0;
-
-    for (int i, i_=0; (i=index[i_]); i_++) {
-        for (int j=threadIdx.x; j<m; j += blockDim.x) Si[j] = S[i*m+j];
-        __syncthreads();
+    // the first row ready, the second one in flight
+    int i = index[0];
+    if (i) {
+        mix_row_issue(Sbuf, raw, S+i*m, m);
+        mix_row_complete(Sbuf, raw, S+i*m, m);
+    }
+    __syncthreads();
+    if (i && index[1]) mix_row_issue(Sbuf+m, raw, S+index[1]*m, m);
 
-        const float Sii = Snrms[i], Vik = V[i*k+kk];
+    float delta = 0; // this warp's share
+    for (int i_=0; (i=index[i_]); i_++) {
+        const float *Si = Sbuf + i_%3*m;
+        const int inext = index[i_+1], slot = i_ & 1;
+        const float Sii = Snrms[i];
 
-        // val = Wk'Si - Sii Vik
-        const float val = warpdot(Wbuf+kk*mbuf, Si, mbuf) 
-                        + warpdot(W+kk*m+mbuf, Si+mbuf, mrem) 
-                        - Sii * Vik;
-        if (lane == 0) g[kk] = val;
+        // g = W Si - Sii Vi
+        float p = 0;
+        #pragma unroll
+        for (int kk=warp; kk<k; kk+=nwarp) {
+            const float val = warpdot(Wbuf+kk*mbuf, Si, mbuf) 
+                            + warpdot(W+kk*m+mbuf, Si+mbuf, mrem) 
+                            - Sii * V[i*k+kk];
+            if (lane == 0) g[kk] = val;
+            p += is_forward ? val*val : Vproj[i*k+kk]*val;
+        }
+        if (lane == 0) part[slot][warp] = p;
+        if (inext) mix_row_complete(Sbuf + (i_+1)%3*m, raw, S+inext*m, m);
         __syncthreads();
+        // into the buffer of the previous coordinate, which every warp is done with
+        if (inext && index[i_+2]) mix_row_issue(Sbuf + (i_+2)%3*m, raw, S+index[i_+2]*m, m);
 
-        float gnrmi, t;
+        const float sum = warpsum(lane < nwarp ? part[slot][lane] : 0);
+        float gnrmi, c;
         if (is_forward) { // gnrm is calculated in the forward pass
-            gnrmi = sqrtf(warpdot(g,g,k));
-            t = -val;
+            gnrmi = sqrtf(sum);
         } else { // In the backward pass, t = -(I-vi vi')(g + v0 dzi) 
             gnrmi = gnrm[i]+prox_lam;
-            float c = warpdot(Vproj+i*k, g, k) + dz[i] * Vproj[i*k];
-            t = -val + c * Vproj[i*k+kk] - dz[i] * Vproj[kk];
+            c = sum + dz[i] * Vproj[i*k];
         }
-        t = t/gnrmi-Vik;
-        __syncthreads();
 
-        if (lane==0) g[kk] = t, V[i*k+kk] += t;
+        float tt = 0;
+        #pragma unroll
+        for (int kk=warp; kk<k; kk+=nwarp) {
+            const float Vik = V[i*k+kk];
+            float t = is_forward ? -g[kk] : -g[kk] + c * Vproj[i*k+kk] - dz[i] * Vproj[kk];
+            t = t/gnrmi-Vik;
 
-        // W += (vi^new-vi^old) Si'
-        #pragma unroll 2
-        for (int j=lane; j<mbuf; j+=WARP_SIZE) Wbuf[kk*mbuf+j] += t* Si[j];
-        for (int j=lane; j<mrem; j+=WARP_SIZE) W[kk*m+mbuf+j] += t* Si[j+mbuf];
-        __syncthreads();
-        if (is_forward) {
-            // Calc function decrease
-            float gg = warpdot(g, g, k);
-            if (threadIdx.x == 0) delta += gnrmi * gg, gnrm[i] = gnrmi;
+            // W += (vi^new-vi^old) Si'
+            #pragma unroll 2
+            for (int j=lane; j<mbuf; j+=WARP_SIZE) Wbuf[kk*mbuf+j] += t* Si[j];
+            for (int j=lane; j<mrem; j+=WARP_SIZE) W[kk*m+mbuf+j] += t* Si[j+mbuf];
+            __syncwarp();
+            if (lane==0) V[i*k+kk] = Vik + t;
+            tt += t*t;
         }
-        __threadfence_block();
+        // Calc function decrease, |ui^new-ui^old|^2 in the backward pass
+        delta += (is_forward ? gnrmi : 1) * tt;
+        if (is_forward && threadIdx.x == 0) gnrm[i] = gnrmi;
     }
+
+    for (int kk=warp; kk<k; kk+=nwarp)
+        for (int j=lane; j<mbuf; j+=WARP_SIZE) W[kk*m+j] = Wbuf[kk*mbuf+j];
+
+    // sum of the warps' shares, returned to every thread
     __syncthreads();
+    if (lane == 0) part[0][warp] = delta;
+    __syncthreads();
+    return warpsum(lane < nwarp ? part[0][lane] : 0);
+}
 
-    for (int j=lane; j<mbuf; j+=WARP_SIZE) W[kk*m+j] = Wbuf[kk*mbuf+j];
-    __threadfence_block();
+/*  Work queue of the persistent kernels below. The grid only holds as many
+ *  blocks (or warps, in warp mode) as fit on the device at once, and each of
+ *  them pulls the next instance from a global counter as soon as it is done
+ *  with the previous one. Converged instances thus free their slot at once,
+ *  and the instances are started in the order given by `order` (NULL for
+ *  0..b-1): the backward pass runs the longest instances first, so the tail
+ *  is not a single straggler.
+ */
+__device__ __forceinline__
+int mix_next_instance(int b, int32_t *queue, const int32_t *order)
+{
+    __shared__ int q;
+    __syncthreads(); // every thread is done with the previous q
+    if (threadIdx.x == 0) q = atomicAdd(queue, 1);
+    __syncthreads();
+    return q >= b ? -1 : order ? order[q] : q;
+}
 
-    return delta;
+__device__ __forceinline__
+int mix_next_instance_warp(int b, int32_t *queue, const int32_t *order)
+{
+    int q = 0;
+    if (threadIdx.x % WARP_SIZE == 0) q = atomicAdd(queue, 1);
+    q = __shfl_sync(0xffffffff, q, 0);
+    return q >= b ? -1 : order ? order[q] : q;
 }
 
-// consider the \min unsat problem,
-__global__ void mix_forward(int max_iter, float eps, int n, int m, int k, const int32_t *index, int32_t *niter, const float *S, float *z, float *V, float *W, float *gnrm, float *Snrms, float *cache)
+// sweeps of the backward pass, see mix_backward_sweeps in satnet_cpu.cpp;
+// every thread of the caller gets the same delta from a sweep
+template <typename F>
+__device__ __forceinline__
+int mix_backward_sweeps(int max_iter, float eps, int niter, F sweep)
 {
-    z +=        n * blockIdx.x;
-    index +=    n * blockIdx.x;
-    V +=        n*k*blockIdx.x;
-    W +=        m*k*blockIdx.x;
-    gnrm +=     n * blockIdx.x;
+    if (eps <= 0) {
+        for (int iter=0; iter<niter; iter++) sweep();
+        return niter;
+    }
+    float tol = 0;
+    int iter = 0;
+    for (; iter < max_iter; iter++) {
+        float delta = sweep();
+        if (iter == 0) tol = delta*eps;
+        // <=, so that a first sweep leaving U at 0 (zero dz) stops at once
+        if ((iter || delta <= 0) && delta <= tol) break;
+    }
+    return iter;
+}
 
-    extern __shared__ float smem[];
+// consider the \min unsat problem,
+template <int K, typename T>
+__device__ __forceinline__
+void mix_forward_instance(int bi, int max_iter, float eps, int n, int m, int k, int mbuf, const int32_t *index, int32_t *niter, float *delta0, float *delta_last, const T *S, float *z, float *V, float *W, float *gnrm, float *Snrms, float *smem)
+{
+    z +=        n * bi;
+    index +=    n * bi;
+    V +=        n*k*bi;
+    W +=        m*k*bi;
+    gnrm +=     n * bi;
 
-    float delta;
+    // relative to the first sweep of the cold solve, see the CPU mix_forward
+    float delta = 0, delta_0 = delta0[bi], tol = delta_0*eps;
     int iter = 0;
     for (; iter < max_iter; iter++) {
-        delta = mix_kernel(1, 0, m, k, index, S, NULL, V, NULL, W, gnrm, Snrms, smem);
-        if (iter && delta < eps) break;
-        if (iter == 0) eps = delta*eps;
+        delta = mix_kernel<K>(1, 0, m, k, mbuf, index, S, NULL, V, NULL, W, gnrm, Snrms, smem);
+        if (iter && delta < tol) break;
+        if (iter == 0 && delta_0 <= 0) delta_0 = delta, tol = delta*eps;
     }
-    niter[blockIdx.x] = iter;
+    if (threadIdx.x == 0) niter[bi] = iter, delta0[bi] = delta_0, delta_last[bi] = delta;
 
     for (int i,i_=0; (i=index[i_]); i_++) {
         float zi = V[i*k];
@@ -166,25 +441,49 @@ __global__ void mix_forward(int max_iter, float eps, int n, int m, int k, const
         zi = saturate(1-acosf(zi)/M_PI);
         if (threadIdx.x == 0) z[i] = zi;
     }
-
 }
 
-__global__ void mix_backward(float prox_lam, int n, int m, int k, int32_t *is_input, int32_t *index, int32_t *niter, const float *S, float *dS, float *z, float *dz, const float *V, float *U, float *W, float *Phi, float *gnrm, float *Snrms, float *cache)
+template <int K, typename T>
+__global__ void mix_forward(int b, int32_t *queue, const int32_t *order, int max_iter, float eps, int n, int m, int k, int mbuf, const int32_t *index, int32_t *niter, float *delta0, float *delta, const T *S, float *z, float *V, float *W, float *gnrm, float *Snrms, float *cache)
 {
-    gnrm += n * blockIdx.x;
-    z +=    n * blockIdx.x;
-    index += n* blockIdx.x;
-    V +=    n*k*blockIdx.x;
-    W +=    m*k*blockIdx.x;
-    Phi +=   m*k*blockIdx.x;
-    U +=   n*k*blockIdx.x;
-    dz +=   n * blockIdx.x;
-    dS +=   n*m*blockIdx.x;
+    extern __shared__ float smem[];
+    for (int bi; (bi = mix_next_instance(b, queue, order)) >= 0; )
+        mix_forward_instance<K>(bi, max_iter, eps, n, m, k, mbuf, index, niter, delta0, delta, S, z, V, W, gnrm, Snrms, smem);
+}
 
+// mix_forward for a grouped solve: the queue hands out the instances of all
+// problems, problem after problem. The block is sized for the largest of
+// them, and the generic kernel (K = 0) leaves the warps without rows idle.
+template <typename T>
+__global__ void mix_forward_grouped(int ngroup, int total, const mix_group_t *group, int32_t *queue)
+{
     extern __shared__ float smem[];
+    for (int q; (q = mix_next_instance(total, queue, NULL)) >= 0; ) {
+        int p = 0;
+        while (p+1 < ngroup && group[p+1].first <= q) p++;
+        const mix_group_t &g = group[p];
+        const mix_t &mix = g.mix;
+        mix_forward_instance<0>(q - g.first, g.max_iter, g.eps, mix.n, mix.m, mix.k, g.mbuf, mix.index,
+                mix.niter, mix.delta0, mix.delta, (const T *)mix.S, mix.z, mix.V, mix.W, mix.gnrm, mix.Snrms, smem);
+    }
+}
+
+template <int K, typename T>
+__device__ __forceinline__
+void mix_backward_instance(int bi, float prox_lam, int max_iter, float eps, int n, int m, int k, int mbuf, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid, const T *S, float *z, float *dz, const float *V, float *U, float *W, float *Phi, float *gnrm, float *Snrms, float *smem)
+{
+    gnrm += n * bi;
+    z +=    n * bi;
+    index += n* bi;
+    V +=    n*k*bi;
+    W +=    m*k*bi;
+    Phi +=   m*k*bi;
+    U +=   n*k*bi;
+    dz +=   n * bi;
+    is_input += n * bi;
 
     __shared__ int invalid_flag;
-    if (threadIdx.x == 0) invalid_flag = 0;
+    if (threadIdx.x == 0) invalid_flag = 0, invalid[bi] = MIX_VALID, bw_niter[bi] = 0;
     __syncthreads();
 
 
@@ -198,80 +497,716 @@ __global__ void mix_backward(float prox_lam, int n, int m, int k, int32_t *is_in
     __syncthreads();
     __threadfence_block();
 
-    if (invalid_flag) {
+    if (invalid_flag) { // drop this instance from dS, see mix_dS_launcher
+        if (threadIdx.x == 0) invalid[bi] = MIX_INVALID_DZ;
         for (int i=threadIdx.x; i<n; i+=blockDim.x) dz[i] = 0;
+        for (int ik=threadIdx.x; ik<n*k; ik+=blockDim.x) U[ik] = 0;
+        for (int kj=threadIdx.x; kj<k*m; kj+=blockDim.x) Phi[kj] = 0;
         return;
     }
 
     // solve P (S'S+D_z-D_sii)xI_k P U = -dz P v0
-    int iter = 0;
-    for (; iter<niter[blockIdx.x]; iter++) {
-        mix_kernel(0, prox_lam, m, k, index, S, dz, U, V, Phi, gnrm, Snrms, smem);
-    }
+    int iter = mix_backward_sweeps(max_iter, eps, niter[bi], [&] {
+        return mix_kernel<K>(0, prox_lam, m, k, mbuf, index, S, dz, U, V, Phi, gnrm, Snrms, smem);
+    });
+    if (threadIdx.x == 0) bw_niter[bi] = iter;
 
     // sanity check
     for (int ik=threadIdx.x; ik<n*k; ik+=blockDim.x) 
         if (isnan(U[ik]) || isinf(U[ik])) invalid_flag = 1;
     __syncthreads();
-    if (invalid_flag) {
+    if (invalid_flag) { // drop this instance from dS, see mix_dS_launcher
+        if (threadIdx.x == 0) invalid[bi] = MIX_INVALID_U;
         for (int i=threadIdx.x; i<n; i+=blockDim.x) dz[i] = 0;
+        for (int ik=threadIdx.x; ik<n*k; ik+=blockDim.x) U[ik] = 0;
+        for (int kj=threadIdx.x; kj<k*m; kj+=blockDim.x) Phi[kj] = 0;
         return;
     }
 
+    int nwarp = blockDim.x / WARP_SIZE;
     int warp = threadIdx.x / WARP_SIZE;
     int lane = threadIdx.x % WARP_SIZE;
 
-    // dS = U W + V Phi
-    for (int ij=threadIdx.x; ij<n*m; ij+=blockDim.x) {
-        float val = 0;
-        for (int kk=0; kk<k; kk++)
-            val += U[ij/m*k+kk]*W[kk*m+ij%m] + V[ij/m*k+kk]*Phi[kk*m+ij%m];
-        dS[ij] = val;
-    }
-
-    // dzi = v0'Phi si
-    __syncthreads();
-    for (int i=1; i<n; i++) {
+    // dzi = v0'Phi si for all inputs at once, the product of their rows of S
+    // with the rows 0 and 1 of Phi: one input per warp, both rows of Phi in
+    // one pass over Si, and no barriers
+    __syncthreads(); // Phi is complete
+    for (int i=1+warp; i<n; i+=nwarp) {
         if (!is_input[i]) {
-            if (threadIdx.x == 0) dz[i] = 0;
+            if (lane == 0) dz[i] = 0;
             continue;
         }
-        __shared__ float val1, val2;
-        __syncthreads();
-        for (int kk=warp; kk<k; kk+=WARP_NUM) {
-            float val = warpdot(S+i*m, Phi+kk*m, m);
-            __syncwarp();
-            if (kk == 0) val1 = val;
-            if (kk == 1) val2 = val;
-            __syncwarp();
+        float val1 = 0, val2 = 0;
+        for (int j=lane; j<m; j+=WARP_SIZE) {
+            const float Sij = to_f(S[i*m+j]);
+            val1 += Sij*Phi[j], val2 += Sij*Phi[m+j];
         }
-        __syncthreads();
-        if (threadIdx.x == 0){
+        val1 = warpsum(val1), val2 = warpsum(val2);
+        if (lane == 0)
             dz[i] = (dz[i] + val1) * sinpif(z[i])*M_PI + val2 * copysign(cospif(z[i])*M_PI, V[i*k+1])*M_PI;
-        }
-        __syncthreads();
     }
 }
 
-void mix_init_launcher_cuda(mix_t mix, int32_t *perm, cudaStream_t stream)
+template <int K, typename T>
+__global__ void mix_backward(int b, int32_t *queue, const int32_t *order, float prox_lam, int max_iter, float eps, int n, int m, int k, int mbuf, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid, const T *S, float *z, float *dz, const float *V, float *U, float *W, float *Phi, float *gnrm, float *Snrms, float *cache)
 {
-        mix_init<<<mix.b,WARP_SIZE*WARP_NUM,0,stream>>>(perm,
+    extern __shared__ float smem[];
+    for (int bi; (bi = mix_next_instance(b, queue, order)) >= 0; )
+        mix_backward_instance<K>(bi, prox_lam, max_iter, eps, n, m, k, mbuf, is_input, index, niter, bw_niter, invalid, S, z, dz, V, U, W, Phi, gnrm, Snrms, smem);
+}
+
+template <typename T>
+static void mix_init_launcher(mix_t mix, int32_t *perm, int perm_stride, cudaStream_t stream)
+{
+        mix_init<<<mix.b,WARP_SIZE*WARP_NUM,0,stream>>>(perm, perm_stride,
                 mix.n, mix.k, mix.is_input, mix.index, mix.z,
                 mix.V);
+        mix_snrms<<<(mix.n+WARP_NUM-1)/WARP_NUM,WARP_SIZE*WARP_NUM,0,stream>>>(
+                mix.n, mix.m, (const T *)mix.S, mix.Snrms);
+
+        // the GEMM reads a 16-bit S widened to FP32, once unless the caller
+        // keeps that copy around (mix.Sf_ready)
+        const float *S = (const float *)mix.S;
+        if (mix.dtype != MIX_FP32) {
+            const long long nm = (long long)mix.n*mix.m;
+            if (!mix.Sf_ready)
+                mix_widen<<<mix_grid(nm),WARP_SIZE*WARP_NUM,0,stream>>>(nm, (const T *)mix.S, mix.UVt);
+            S = mix.UVt;
+        }
+
+        // W_b = V_b' S for the whole batch in one strided-batched GEMM. In
+        // cuBLAS' column-major view W_b is m x k, S is m x n (shared by all
+        // instances, stride 0) and V_b is k x n.
+        const float one = 1, zero = 0;
+        cublasHandle_t handle = at::cuda::getCurrentCUDABlasHandle();
+        cublasSetStream(handle, stream);
+        cublasStatus_t st = cublasSgemmStridedBatched(handle, CUBLAS_OP_N, CUBLAS_OP_T,
+                mix.m, mix.k, mix.n, &one,
+                S, mix.m, 0,
+                mix.V, mix.k, (long long)mix.n*mix.k, &zero,
+                mix.W, mix.m, (long long)mix.m*mix.k, mix.b);
+        TORCH_CHECK(st == CUBLAS_STATUS_SUCCESS, "SATNet W init: cuBLAS error ", (int)st);
+}
+
+void mix_init_launcher_cuda(mix_t mix, int32_t *perm, int perm_stride, cudaStream_t stream)
+{
+    MIX_SWITCH_T(mix.dtype, mix_init_launcher<T>(mix, perm, perm_stride, stream));
+}
+
+void mix_update_launcher_cuda(mix_t mix, int32_t *perm, int perm_stride, const int32_t *changed, cudaStream_t stream)
+{
+    MIX_SWITCH_T(mix.dtype,
+        mix_update<T><<<mix.b,WARP_SIZE*WARP_NUM,mix.k*sizeof(float),stream>>>(perm, perm_stride,
+                mix.n, mix.m, mix.k, changed, mix.is_input, mix.index, mix.z,
+                mix.V, (const T *)mix.S, mix.W));
+}
+
+/*  Warp-per-instance variant of the mixing method for small problems.
+ *
+ *  The per-block kernels above spend most of their time in __syncthreads()
+ *  when n and m are small. Here each warp solves a whole instance: lane kk
+ *  owns the rows kk of V and W, W is kept transposed in shared memory
+ *  (Wt[j*k+kk], conflict-free across lanes) and all reductions over k are
+ *  warp shuffles, so only __syncwarp() is needed. Requires k <= WARP_SIZE.
+ */
+template <int K, typename T>
+__forceinline__
+__device__ float mix_kernel_warp(const int is_forward, float prox_lam,
+        int m, int k_, const int32_t *__restrict__ index, 
+        const T *__restrict__ S, const float *__restrict__ dz, float *__restrict__ V, const float *__restrict__ Vproj,
+        float *__restrict__ Wt, float *__restrict__ gnrm, const float *__restrict__ Snrms, float *__restrict__ Si)
+{
+    const int k = K ? K : k_;
+    const int lane = threadIdx.x % WARP_SIZE;
+    const bool own = lane < k;
+
+    float delta = 0;
+    for (int i, i_=0; (i=index[i_]); i_++) {
+        __syncwarp();
+        for (int j=lane; j<m; j+=WARP_SIZE) Si[j] = to_f(S[i*m+j]);
+        __syncwarp();
+
+        // g = W Si - Sii Vi, one row per lane
+        float val = 0, Vik = 0;
+        if (own) {
+            Vik = V[i*k+lane];
+            for (int j=0; j<m; j++) val += Wt[j*k+lane]*Si[j];
+            val -= Snrms[i]*Vik;
+        }
+
+        float gnrmi, t;
+        if (is_forward) {
+            gnrmi = sqrtf(warpsum(val*val));
+            t = -val;
+        } else { // t = -(I-vi vi')(g + v0 dzi)
+            gnrmi = gnrm[i]+prox_lam;
+            float c = warpsum(own ? Vproj[i*k+lane]*val : 0) + dz[i] * Vproj[i*k];
+            t = own ? -val + c * Vproj[i*k+lane] - dz[i] * Vproj[lane] : 0;
+        }
+        t = own ? t/gnrmi-Vik : 0;
+
+        // W += (vi^new-vi^old) Si'
+        if (own) {
+            V[i*k+lane] = Vik + t;
+            for (int j=0; j<m; j++) Wt[j*k+lane] += t*Si[j];
+        }
+        delta += (is_forward ? gnrmi : 1) * warpsum(t*t);
+        if (is_forward && lane == 0) gnrm[i] = gnrmi;
+    }
+    return delta;
+}
+
+// W (k*m, row-major) <-> Wt (m*k) in the warp's shared memory
+__device__ __forceinline__
+void warp_load_transposed(float *Wt, const float *W, int m, int k)
+{
+    for (int jk=threadIdx.x % WARP_SIZE; jk<m*k; jk+=WARP_SIZE) Wt[jk%m*k+jk/m] = W[jk];
+    __syncwarp();
+}
+
+__device__ __forceinline__
+void warp_store_transposed(float *W, const float *Wt, int m, int k)
+{
+    __syncwarp();
+    for (int jk=threadIdx.x % WARP_SIZE; jk<m*k; jk+=WARP_SIZE) W[jk] = Wt[jk%m*k+jk/m];
+}
+
+template <int K, typename T>
+__device__ __forceinline__
+void mix_forward_warp_instance(int bi, int max_iter, float eps, int n, int m, int k, const int32_t *index, int32_t *niter, float *delta0, float *delta_last, const T *S, float *z, float *V, float *W, float *gnrm, float *Snrms, float *smem)
+{
+    const int warp = threadIdx.x / WARP_SIZE, lane = threadIdx.x % WARP_SIZE;
+
+    z +=        n * bi;
+    index +=    n * bi;
+    V +=        n*k*bi;
+    W +=        m*k*bi;
+    gnrm +=     n * bi;
+
+    float *Wt = smem + warp*(k+1)*m, *Si = Wt + k*m;
+    warp_load_transposed(Wt, W, m, k);
+
+    float delta = 0, delta_0 = delta0[bi], tol = delta_0*eps;
+    int iter = 0;
+    for (; iter < max_iter; iter++) {
+        delta = mix_kernel_warp<K>(1, 0, m, k, index, S, NULL, V, NULL, Wt, gnrm, Snrms, Si);
+        if (iter && delta < tol) break;
+        if (iter == 0 && delta_0 <= 0) delta_0 = delta, tol = delta*eps;
+    }
+    if (lane == 0) niter[bi] = iter, delta0[bi] = delta_0, delta_last[bi] = delta;
+    warp_store_transposed(W, Wt, m, k);
+
+    for (int i,i_=lane; i_<n && (i=index[i_]); i_+=WARP_SIZE) {
+        float zi = V[i*k];
+        zi = saturate((zi+1)/2)*2-1;
+        zi = saturate(1-acosf(zi)/M_PI);
+        z[i] = zi;
+    }
+}
+
+template <int K, typename T>
+__global__ void mix_forward_warp(int b, int32_t *queue, const int32_t *order, int max_iter, float eps, int n, int m, int k, const int32_t *index, int32_t *niter, float *delta0, float *delta, const T *S, float *z, float *V, float *W, float *gnrm, float *Snrms)
+{
+    extern __shared__ float smem[];
+    for (int bi; (bi = mix_next_instance_warp(b, queue, order)) >= 0; )
+        mix_forward_warp_instance<K>(bi, max_iter, eps, n, m, k, index, niter, delta0, delta, S, z, V, W, gnrm, Snrms, smem);
+}
+
+template <int K, typename T>
+__device__ __forceinline__
+void mix_backward_warp_instance(int bi, float prox_lam, int max_iter, float eps, int n, int m, int k, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid_out, const T *S, float *z, float *dz, const float *V, float *U, float *W, float *Phi, float *gnrm, float *Snrms, float *smem)
+{
+    const int warp = threadIdx.x / WARP_SIZE, lane = threadIdx.x % WARP_SIZE;
+
+    gnrm += n * bi;
+    z +=    n * bi;
+    index += n* bi;
+    is_input += n * bi;
+    V +=    n*k*bi;
+    W +=    m*k*bi;
+    Phi +=  m*k*bi;
+    U +=    n*k*bi;
+    dz +=   n * bi;
+
+    float *Pt = smem + warp*(k+1)*m, *Si = Pt + k*m;
+
+    int invalid = 0;
+    for (int i,i_=lane; i_<n && (i=index[i_]); i_+=WARP_SIZE) {
+        float dzi = dz[i]/M_PI/sinpif(z[i]);
+        if (isnan(dzi) || isinf(dzi) || gnrm[i] < MEPS) invalid = 1;
+        dz[i] = dzi;
+    }
+    if (lane == 0) invalid_out[bi] = MIX_VALID, bw_niter[bi] = 0;
+    if (__any_sync(0xffffffff, invalid)) { // drop this instance from dS
+        if (lane == 0) invalid_out[bi] = MIX_INVALID_DZ;
+        __syncwarp();
+        for (int i=lane; i<n; i+=WARP_SIZE) dz[i] = 0;
+        for (int ik=lane; ik<n*k; ik+=WARP_SIZE) U[ik] = 0;
+        for (int kj=lane; kj<k*m; kj+=WARP_SIZE) Phi[kj] = 0;
+        return;
+    }
+    __syncwarp();
+
+    // solve P (S'S+D_z-D_sii)xI_k P U = -dz P v0
+    warp_load_transposed(Pt, Phi, m, k);
+    int iter = mix_backward_sweeps(max_iter, eps, niter[bi], [&] {
+        return mix_kernel_warp<K>(0, prox_lam, m, k, index, S, dz, U, V, Pt, gnrm, Snrms, Si);
+    });
+    if (lane == 0) bw_niter[bi] = iter;
+    warp_store_transposed(Phi, Pt, m, k);
+
+    // sanity check
+    for (int ik=lane; ik<n*k; ik+=WARP_SIZE) 
+        if (isnan(U[ik]) || isinf(U[ik])) invalid = 1;
+    if (__any_sync(0xffffffff, invalid)) {
+        if (lane == 0) invalid_out[bi] = MIX_INVALID_U;
+        for (int i=lane; i<n; i+=WARP_SIZE) dz[i] = 0;
+        for (int ik=lane; ik<n*k; ik+=WARP_SIZE) U[ik] = 0;
+        for (int kj=lane; kj<k*m; kj+=WARP_SIZE) Phi[kj] = 0;
+        return;
+    }
+
+    // dzi = v0'Phi si, one input variable per lane
+    for (int i=1+lane; i<n; i+=WARP_SIZE) {
+        if (!is_input[i]) {
+            dz[i] = 0;
+            continue;
+        }
+        float val1 = 0, val2 = 0;
+        for (int j=0; j<m; j++) {
+            const float Sij = to_f(S[i*m+j]);
+            val1 += Sij*Pt[j*k], val2 += Sij*Pt[j*k+1];
+        }
+        dz[i] = (dz[i] + val1) * sinpif(z[i])*M_PI + val2 * copysign(cospif(z[i])*M_PI, V[i*k+1])*M_PI;
+    }
+}
+
+template <int K, typename T>
+__global__ void mix_backward_warp(int b, int32_t *queue, const int32_t *order, float prox_lam, int max_iter, float eps, int n, int m, int k, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid, const T *S, float *z, float *dz, const float *V, float *U, float *W, float *Phi, float *gnrm, float *Snrms)
+{
+    extern __shared__ float smem[];
+    for (int bi; (bi = mix_next_instance_warp(b, queue, order)) >= 0; )
+        mix_backward_warp_instance<K>(bi, prox_lam, max_iter, eps, n, m, k, is_input, index, niter, bw_niter, invalid, S, z, dz, V, U, W, Phi, gnrm, Snrms, smem);
+}
+
+// Ut[i][bb*k+kk] = U[bb][i][kk], so that U viewed as n x (b*k) is row-major
+__global__ void mix_gather_t(int b, int n, int k, const float *U, float *Ut)
+{
+    const long long nbk = (long long)n*b*k;
+    for (long long idx = blockIdx.x*(long long)blockDim.x + threadIdx.x; idx < nbk; idx += (long long)gridDim.x*blockDim.x) {
+        const int kk = idx % k, i = idx / k % n, bb = idx / ((long long)n*k);
+        Ut[((long long)i*b + bb)*k + kk] = U[idx];
+    }
+}
+
+/*  dS = sum_b U_b W_b + V_b Phi_b, reduced over the batch in place of the
+ *  per-instance dS_b. With the inner index p = (b, kk) this is two GEMMs
+ *  [U_1..U_b] [W_1;..;W_b] + [V_1..V_b] [Phi_1;..;Phi_b] of inner dimension
+ *  b*k. W and Phi are already (b*k) x m row-major; U and V are gathered into
+ *  n x (b*k) first. cuBLAS sees the transposed, column-major problem
+ *  dS' (m x n) = W' Ut' + Phi' Vt'. `math` selects FP32, TF32 or
+ *  FP16-input/FP32-accumulate tensor-core math.
+ */
+static void mix_dS_launcher(mix_t mix, int math, cudaStream_t stream)
+{
+    const int P = mix.b*mix.k;
+    float *Ut = mix.UVt, *Vt = mix.UVt + (long long)mix.n*P;
+    mix_gather_t<<<mix_grid((long long)mix.n*P),WARP_SIZE*WARP_NUM,0,stream>>>(mix.b, mix.n, mix.k, mix.U, Ut);
+    mix_gather_t<<<mix_grid((long long)mix.n*P),WARP_SIZE*WARP_NUM,0,stream>>>(mix.b, mix.n, mix.k, mix.V, Vt);
+
+    cublasComputeType_t compute = math == MIX_MATH_TF32 ? CUBLAS_COMPUTE_32F_FAST_TF32 :
+                                  math == MIX_MATH_FP16 ? CUBLAS_COMPUTE_32F_FAST_16F : CUBLAS_COMPUTE_32F;
+    cublasGemmAlgo_t algo = math == MIX_MATH_FP32 ? CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+    const float one = 1, zero = 0;
+    cublasHandle_t handle = at::cuda::getCurrentCUDABlasHandle();
+    cublasSetStream(handle, stream);
+    cublasStatus_t st = cublasGemmEx(handle, CUBLAS_OP_N, CUBLAS_OP_N, mix.m, mix.n, P, &one,
+            mix.W, CUDA_R_32F, mix.m, Ut, CUDA_R_32F, P, &zero,
+            mix.dS, CUDA_R_32F, mix.m, compute, algo);
+    if (st == CUBLAS_STATUS_SUCCESS)
+        st = cublasGemmEx(handle, CUBLAS_OP_N, CUBLAS_OP_N, mix.m, mix.n, P, &one,
+            mix.Phi, CUDA_R_32F, mix.m, Vt, CUDA_R_32F, P, &one,
+            mix.dS, CUDA_R_32F, mix.m, compute, algo);
+    TORCH_CHECK(st == CUBLAS_STATUS_SUCCESS, "SATNet dS: cuBLAS error ", (int)st);
+}
+
+// Number of instances packed per block in warp mode, or 0 to run one
+// instance per block. Warp mode is used when k fits in a warp and W, Si of
+// an instance fit in a few KB of shared memory (parity, small Sudoku
+// variants); larger problems have enough work per coordinate to keep a full
+// block busy.
+static int mix_warp_instances(mix_t mix)
+{
+    const int floats = (mix.k+1)*mix.m;
+    if (mix.k > WARP_SIZE || floats > WARP_MODE_MAX_FLOATS) return 0;
+    int ipb = WARP_MODE_SMEM / (floats*(int)sizeof(float));
+    if (ipb > WARP_MODE_MAX_WARPS) ipb = WARP_MODE_MAX_WARPS;
+    if (ipb > mix.b) ipb = mix.b;
+    return ipb;
+}
+
+// Each instance runs on its own block, with one warp per row of W (at most
+// WARP_NUM warps). Wbuf keeps the first mbuf columns of W in shared memory and
+// the remaining m-mbuf are streamed from global memory on every update. The
+// buffer is sized to the device's opt-in limit (227 KB on A100/H100, 48 KB on
+// older parts), so W stays fully on-chip for typical clause counts.
+// shared floats of mix_kernel besides Wbuf
+static int mix_smem_rows(mix_t mix)
+{
+    return mix_row_floats(mix.m, mix.dtype == MIX_FP32 ? 4 : 2);
+}
+
+static int mix_mbuf(mix_t mix)
+{
+    // leave room for the kernels' static __shared__ scalars
+    const int smem = at::cuda::getCurrentDeviceProperties()->sharedMemPerBlockOptin - 1024;
+    int mbuf = (smem/(int)sizeof(float) - mix_smem_rows(mix) - mix.k) / mix.k;
+    if (mbuf < 0) mbuf = 0;
+    return mix.m < mbuf ? mix.m : mbuf;
+}
+
+// Blocks asking for more than SMEM_DEFAULT bytes of dynamic shared memory
+// must opt in per kernel before launch.
+template <typename F>
+static void mix_smem_optin(F *kernel, int smem_size)
+{
+    if (smem_size > SMEM_DEFAULT)
+        cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size);
+}
+
+static int mix_nthreads(mix_t mix)
+{
+    return WARP_SIZE * (mix.k < WARP_NUM ? mix.k : WARP_NUM);
+}
+
+// Grid of the persistent kernels: as many blocks as are resident on the
+// device at once, but no more than there are blocks of work.
+template <typename F>
+static int mix_persistent_grid(F *kernel, int nthreads, int smem_size, int nblocks)
+{
+    int per_sm = 0;
+    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&per_sm, kernel, nthreads, smem_size);
+    const int resident = std::max(per_sm, 1) * at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    return std::min(nblocks, resident);
 }
 
 void mix_forward_launcher_cuda(mix_t mix, int max_iter, float eps, cudaStream_t stream)
 {
-    int smem_size = (mix.m+mix.k*(1+MBUF_SIZE))*sizeof(float);
-    mix_forward<<<mix.b,WARP_SIZE*WARP_NUM,smem_size,stream>>>(max_iter, eps,
-            mix.n, mix.m, mix.k, mix.index, mix.niter, 
-            mix.S, mix.z, mix.V, mix.W, mix.gnrm, mix.Snrms, mix.cache);
+    cudaMemsetAsync(mix.queue, 0, sizeof(int32_t), stream);
+    if (int ipb = mix_warp_instances(mix)) {
+        int smem_size = ipb*(mix.k+1)*mix.m*sizeof(float);
+        MIX_SWITCH_T(mix.dtype, MIX_SWITCH_K(mix.k,
+            int grid = mix_persistent_grid(mix_forward_warp<K, T>, ipb*WARP_SIZE, smem_size, (mix.b+ipb-1)/ipb);
+            mix_forward_warp<K, T><<<grid,ipb*WARP_SIZE,smem_size,stream>>>(mix.b, mix.queue, mix.order, max_iter, eps,
+                mix.n, mix.m, mix.k, mix.index, mix.niter, mix.delta0, mix.delta,
+                (const T *)mix.S, mix.z, mix.V, mix.W, mix.gnrm, mix.Snrms)));
+        return;
+    }
+
+    int mbuf = mix_mbuf(mix);
+    int smem_size = (mix_smem_rows(mix)+mix.k*(1+mbuf))*sizeof(float);
+    MIX_SWITCH_T(mix.dtype, MIX_SWITCH_K(mix.k,
+        mix_smem_optin(mix_forward<K, T>, smem_size);
+        int grid = mix_persistent_grid(mix_forward<K, T>, mix_nthreads(mix), smem_size, mix.b);
+        mix_forward<K, T><<<grid,mix_nthreads(mix),smem_size,stream>>>(mix.b, mix.queue, mix.order, max_iter, eps,
+            mix.n, mix.m, mix.k, mbuf, mix.index, mix.niter, mix.delta0, mix.delta,
+            (const T *)mix.S, mix.z, mix.V, mix.W, mix.gnrm, mix.Snrms, mix.cache)));
+}
+
+// Several problems of different S, sizes and batches in one forward launch,
+// so that small problems fill the device together. Their init still runs per
+// problem, one strided-batched GEMM each, since S differs between them; the
+// forward, which dominates, is a single persistent kernel over all their
+// instances. The problems must share the storage format of S.
+void mix_solve_grouped_launcher_cuda(mix_group_t *group, int ngroup, cudaStream_t stream)
+{
+    int total = 0, nthreads = WARP_SIZE, smem_size = 0;
+    for (int p = 0; p < ngroup; p++) {
+        mix_group_t &g = group[p];
+        mix_init_launcher_cuda(g.mix, g.perm, g.perm_stride, stream);
+        g.first = total;
+        total += g.mix.b;
+        g.mbuf = mix_mbuf(g.mix);
+        smem_size = std::max<int>(smem_size, (mix_smem_rows(g.mix)+g.mix.k*(1+g.mbuf))*sizeof(float));
+        nthreads = std::max(nthreads, mix_nthreads(g.mix));
+    }
+
+    // the descriptors go with the launch; the caching allocator keeps them
+    // alive until the stream is past the kernel
+    const size_t bytes = ngroup*sizeof(mix_group_t);
+    at::DataPtr dgroup = at::cuda::getCUDADeviceAllocator()->allocate(bytes);
+    cudaMemcpyAsync(dgroup.get(), group, bytes, cudaMemcpyHostToDevice, stream);
+    int32_t *queue = group[0].mix.queue;
+    cudaMemsetAsync(queue, 0, sizeof(int32_t), stream);
+    MIX_SWITCH_T(group[0].mix.dtype,
+        mix_smem_optin(mix_forward_grouped<T>, smem_size);
+        int grid = mix_persistent_grid(mix_forward_grouped<T>, nthreads, smem_size, total);
+        mix_forward_grouped<T><<<grid,nthreads,smem_size,stream>>>(ngroup, total,
+            (const mix_group_t *)dgroup.get(), queue));
+}
+
+void mix_backward_launcher_cuda(mix_t mix, float prox_lam, int max_iter, float eps, int math, cudaStream_t stream)
+{
+    cudaMemsetAsync(mix.queue, 0, sizeof(int32_t), stream);
+    if (int ipb = mix_warp_instances(mix)) {
+        int smem_size = ipb*(mix.k+1)*mix.m*sizeof(float);
+        MIX_SWITCH_T(mix.dtype, MIX_SWITCH_K(mix.k,
+            int grid = mix_persistent_grid(mix_backward_warp<K, T>, ipb*WARP_SIZE, smem_size, (mix.b+ipb-1)/ipb);
+            mix_backward_warp<K, T><<<grid,ipb*WARP_SIZE,smem_size,stream>>>(mix.b, mix.queue, mix.order, prox_lam, max_iter, eps,
+               mix.n, mix.m, mix.k, mix.is_input, mix.index, mix.niter, mix.bw_niter, mix.invalid,
+               (const T *)mix.S, mix.z, mix.dz, mix.V, mix.U, mix.W, mix.Phi, mix.gnrm, mix.Snrms)));
+    } else {
+        int mbuf = mix_mbuf(mix);
+        int smem_size = (mix_smem_rows(mix)+mix.k*(1+mbuf))*sizeof(float);
+        MIX_SWITCH_T(mix.dtype, MIX_SWITCH_K(mix.k,
+            mix_smem_optin(mix_backward<K, T>, smem_size);
+            int grid = mix_persistent_grid(mix_backward<K, T>, mix_nthreads(mix), smem_size, mix.b);
+            mix_backward<K, T><<<grid,mix_nthreads(mix),smem_size,stream>>>(mix.b, mix.queue, mix.order, prox_lam, max_iter, eps,
+               mix.n, mix.m, mix.k, mbuf, mix.is_input, mix.index, mix.niter, mix.bw_niter, mix.invalid,
+               (const T *)mix.S, mix.z, mix.dz, mix.V, mix.U, mix.W, mix.Phi, mix.gnrm, mix.Snrms, mix.cache)));
+    }
+    mix_dS_launcher(mix, math, stream);
+}
+
+/*  Sparse S in CSR form (see mix_kernel_sparse in satnet_cpu.cpp): mix.S holds
+ *  the nnz values at the columns mix.Scol, rows delimited by mix.Srow, and W,
+ *  Phi are stored transposed, m x k. Every warp solves an instance with lane
+ *  kk owning the entries kk, kk+WARP_SIZE, ... of g and vi, so a coordinate
+ *  reads and updates only the nnz(Si) rows of Wt it touches, each a
+ *  coalesced k-vector. g lives in the warp's k floats of shared memory.
+ */
+template <int K>
+__forceinline__
+__device__ float mix_kernel_sparse(const int is_forward, float prox_lam, int k_,
+        const int32_t *__restrict__ index, const int32_t *__restrict__ row,
+        const int32_t *__restrict__ col, const float *__restrict__ val,
+        const float *__restrict__ dz, float *__restrict__ V, const float *__restrict__ Vproj,
+        float *__restrict__ Wt, float *__restrict__ gnrm, const float *__restrict__ Snrms, float *__restrict__ g)
+{
+    const int k = K ? K : k_;
+    const int lane = threadIdx.x % WARP_SIZE;
+
+    float delta = 0;
+    for (int i, i_=0; (i=index[i_]); i_++) {
+        const int p0 = row[i], p1 = row[i+1];
+
+        // g = W Si - Sii vi over the nonzeros of Si
+        float part = 0;
+        for (int kk=lane; kk<k; kk+=WARP_SIZE) {
+            float gk = -Snrms[i]*V[i*k+kk];
+            for (int p=p0; p<p1; p++) gk += val[p]*Wt[col[p]*k+kk];
+            g[kk] = gk;
+            part += is_forward ? gk*gk : Vproj[i*k+kk]*gk;
+        }
+
+        float gnrmi, c = 0;
+        if (is_forward) {
+            gnrmi = sqrtf(warpsum(part));
+        } else { // t = -(I-vi vi')(g + v0 dzi)
+            gnrmi = gnrm[i]+prox_lam;
+            c = warpsum(part) + dz[i] * Vproj[i*k];
+        }
+
+        float d = 0;
+        for (int kk=lane; kk<k; kk+=WARP_SIZE) {
+            float t = -g[kk];
+            if (!is_forward) t += c * Vproj[i*k+kk] - (kk == 0 ? dz[i] : 0);
+            t = t/gnrmi - V[i*k+kk];
+            V[i*k+kk] += t;
+            g[kk] = t;
+            d += t*t;
+        }
+
+        // W += (vi^new-vi^old) Si'
+        for (int p=p0; p<p1; p++)
+            for (int kk=lane; kk<k; kk+=WARP_SIZE) Wt[col[p]*k+kk] += val[p]*g[kk];
+
+        delta += (is_forward ? gnrmi : 1) * warpsum(d);
+        if (is_forward && lane == 0) gnrm[i] = gnrmi;
+    }
+    return delta;
+}
+
+// Snrms[i] = sum of the squared nonzeros of row i, one warp per row
+__global__ void mix_snrms_sparse(int n, const int32_t *row, const float *val, float *Snrms)
+{
+    int i = blockIdx.x * (blockDim.x / WARP_SIZE) + threadIdx.x / WARP_SIZE;
+    if (i >= n) return;
+
+    float s = warpdot(val+row[i], val+row[i], row[i+1]-row[i]);
+    if (threadIdx.x % WARP_SIZE == 0) Snrms[i] = s;
+}
+
+// Wt_b = S'V_b, one warp per instance; the lanes own disjoint columns of Wt,
+// so the sum needs no atomics and is deterministic.
+__global__ void mix_init_W_sparse(int b, int n, int m, int k, const int32_t *row, const int32_t *col, const float *val, const float *V, float *Wt)
+{
+    const int bi = blockIdx.x * (blockDim.x / WARP_SIZE) + threadIdx.x / WARP_SIZE;
+    const int lane = threadIdx.x % WARP_SIZE;
+    if (bi >= b) return;
+
+    V += n*k*bi;
+    Wt += m*k*bi;
+    for (int jk=lane; jk<m*k; jk+=WARP_SIZE) Wt[jk] = 0;
+    __syncwarp();
+    for (int i=0; i<n; i++)
+        for (int p=row[i]; p<row[i+1]; p++)
+            for (int kk=lane; kk<k; kk+=WARP_SIZE) Wt[col[p]*k+kk] += val[p]*V[i*k+kk];
+}
+
+void mix_init_sparse_launcher_cuda(mix_t mix, int32_t *perm, int perm_stride, cudaStream_t stream)
+{
+    mix_init<<<mix.b,WARP_SIZE*WARP_NUM,0,stream>>>(perm, perm_stride,
+            mix.n, mix.k, mix.is_input, mix.index, mix.z,
+            mix.V);
+    mix_snrms_sparse<<<(mix.n+WARP_NUM-1)/WARP_NUM,WARP_SIZE*WARP_NUM,0,stream>>>(
+            mix.n, mix.Srow, (const float *)mix.S, mix.Snrms);
+    mix_init_W_sparse<<<(mix.b+SPARSE_WARPS-1)/SPARSE_WARPS,SPARSE_WARPS*WARP_SIZE,0,stream>>>(
+            mix.b, mix.n, mix.m, mix.k, mix.Srow, mix.Scol, (const float *)mix.S, mix.V, mix.W);
+}
+
+template <int K>
+__global__ void mix_forward_sparse(int b, int32_t *queue, const int32_t *order, int max_iter, float eps, int n, int m, int k, const int32_t *index, int32_t *niter, float *delta0, float *delta_last, const int32_t *row, const int32_t *col, const float *val, float *z, float *V, float *Wt, float *gnrm, float *Snrms)
+{
+    extern __shared__ float smem[];
+    const int warp = threadIdx.x / WARP_SIZE, lane = threadIdx.x % WARP_SIZE;
+    float *g = smem + warp*k;
+
+    for (int bi; (bi = mix_next_instance_warp(b, queue, order)) >= 0; ) {
+        const int32_t *index_b = index + n*bi;
+        float *V_b = V + n*k*bi, *z_b = z + n*bi;
+
+        float delta = 0, delta_0 = delta0[bi], tol = delta_0*eps;
+        int iter = 0;
+        for (; iter < max_iter; iter++) {
+            delta = mix_kernel_sparse<K>(1, 0, k, index_b, row, col, val, NULL, V_b, NULL, Wt + m*k*bi, gnrm + n*bi, Snrms, g);
+            if (iter && delta < tol) break;
+            if (iter == 0 && delta_0 <= 0) delta_0 = delta, tol = delta*eps;
+        }
+        if (lane == 0) niter[bi] = iter, delta0[bi] = delta_0, delta_last[bi] = delta;
+
+        __syncwarp(); // V_b[i*k] of the last sweep, written by other lanes
+        for (int i,i_=lane; i_<n && (i=index_b[i_]); i_+=WARP_SIZE) {
+            float zi = V_b[i*k];
+            zi = saturate((zi+1)/2)*2-1;
+            zi = saturate(1-acosf(zi)/M_PI);
+            z_b[i] = zi;
+        }
+    }
+}
+
+template <int K>
+__device__ __forceinline__
+void mix_backward_sparse_instance(int bi, float prox_lam, int max_iter, float eps, int n, int m, int k, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid_out, const int32_t *row, const int32_t *col, const float *val, float *z, float *dz, const float *V, float *U, float *Phit, float *gnrm, float *Snrms, float *g)
+{
+    const int lane = threadIdx.x % WARP_SIZE;
+
+    gnrm += n * bi;
+    z +=    n * bi;
+    index += n* bi;
+    is_input += n * bi;
+    V +=    n*k*bi;
+    Phit += m*k*bi;
+    U +=    n*k*bi;
+    dz +=   n * bi;
+
+    int invalid = 0;
+    for (int i,i_=lane; i_<n && (i=index[i_]); i_+=WARP_SIZE) {
+        float dzi = dz[i]/M_PI/sinpif(z[i]);
+        if (isnan(dzi) || isinf(dzi) || gnrm[i] < MEPS) invalid = 1;
+        dz[i] = dzi;
+    }
+    if (lane == 0) invalid_out[bi] = MIX_VALID, bw_niter[bi] = 0;
+    if (__any_sync(0xffffffff, invalid)) { // drop this instance from dS
+        if (lane == 0) invalid_out[bi] = MIX_INVALID_DZ;
+        __syncwarp();
+        for (int i=lane; i<n; i+=WARP_SIZE) dz[i] = 0;
+        for (int ik=lane; ik<n*k; ik+=WARP_SIZE) U[ik] = 0;
+        for (int kj=lane; kj<k*m; kj+=WARP_SIZE) Phit[kj] = 0;
+        return;
+    }
+    __syncwarp();
+
+    // solve P (S'S+D_z-D_sii)xI_k P U = -dz P v0
+    int iter = mix_backward_sweeps(max_iter, eps, niter[bi], [&] {
+        return mix_kernel_sparse<K>(0, prox_lam, k, index, row, col, val, dz, U, V, Phit, gnrm, Snrms, g);
+    });
+    if (lane == 0) bw_niter[bi] = iter;
+    __syncwarp();
+
+    // sanity check
+    for (int ik=lane; ik<n*k; ik+=WARP_SIZE) 
+        if (isnan(U[ik]) || isinf(U[ik])) invalid = 1;
+    if (__any_sync(0xffffffff, invalid)) {
+        if (lane == 0) invalid_out[bi] = MIX_INVALID_U;
+        for (int i=lane; i<n; i+=WARP_SIZE) dz[i] = 0;
+        for (int ik=lane; ik<n*k; ik+=WARP_SIZE) U[ik] = 0;
+        for (int kj=lane; kj<k*m; kj+=WARP_SIZE) Phit[kj] = 0;
+        return;
+    }
+
+    // dzi = v0'Phi si, one input variable per lane
+    for (int i=1+lane; i<n; i+=WARP_SIZE) {
+        if (!is_input[i]) {
+            dz[i] = 0;
+            continue;
+        }
+        float val1 = 0, val2 = 0;
+        for (int p=row[i]; p<row[i+1]; p++)
+            val1 += val[p]*Phit[col[p]*k], val2 += val[p]*Phit[col[p]*k+1];
+        dz[i] = (dz[i] + val1) * sinpif(z[i])*M_PI + val2 * copysign(cospif(z[i])*M_PI, V[i*k+1])*M_PI;
+    }
+}
+
+template <int K>
+__global__ void mix_backward_sparse(int b, int32_t *queue, const int32_t *order, float prox_lam, int max_iter, float eps, int n, int m, int k, int32_t *is_input, int32_t *index, int32_t *niter, int32_t *bw_niter, int32_t *invalid, const int32_t *row, const int32_t *col, const float *val, float *z, float *dz, const float *V, float *U, float *Phit, float *gnrm, float *Snrms)
+{
+    extern __shared__ float smem[];
+    float *g = smem + threadIdx.x / WARP_SIZE * k;
+    for (int bi; (bi = mix_next_instance_warp(b, queue, order)) >= 0; )
+        mix_backward_sparse_instance<K>(bi, prox_lam, max_iter, eps, n, m, k, is_input, index, niter, bw_niter, invalid, row, col, val, z, dz, V, U, Phit, gnrm, Snrms, g);
+}
+
+// eq.11 restricted to the pattern of S (an SDDMM), one warp per row of S:
+// dS[p] = sum_b U_b[i]'Wt_b[col[p]] + V_b[i]'Phit_b[col[p]] for p in row i
+__global__ void mix_dS_sparse(int b, int n, int m, int k, const int32_t *row, const int32_t *col, const float *U, const float *V, const float *Wt, const float *Phit, float *dS)
+{
+    int i = blockIdx.x * (blockDim.x / WARP_SIZE) + threadIdx.x / WARP_SIZE;
+    const int lane = threadIdx.x % WARP_SIZE;
+    if (i >= n) return;
+
+    for (int p=row[i]; p<row[i+1]; p++) {
+        const int j = col[p];
+        float s = 0;
+        for (int bk=lane; bk<b*k; bk+=WARP_SIZE) {
+            const long long bn = bk/k, kk = bk%k;
+            s += U[(bn*n+i)*k+kk]*Wt[(bn*m+j)*k+kk] + V[(bn*n+i)*k+kk]*Phit[(bn*m+j)*k+kk];
+        }
+        s = warpsum(s);
+        if (lane == 0) dS[p] = s;
+    }
+}
+
+void mix_forward_sparse_launcher_cuda(mix_t mix, int max_iter, float eps, cudaStream_t stream)
+{
+    cudaMemsetAsync(mix.queue, 0, sizeof(int32_t), stream);
+    int smem_size = SPARSE_WARPS*mix.k*sizeof(float);
+    MIX_SWITCH_K(mix.k,
+        int grid = mix_persistent_grid(mix_forward_sparse<K>, SPARSE_WARPS*WARP_SIZE, smem_size, (mix.b+SPARSE_WARPS-1)/SPARSE_WARPS);
+        mix_forward_sparse<K><<<grid,SPARSE_WARPS*WARP_SIZE,smem_size,stream>>>(mix.b, mix.queue, mix.order, max_iter, eps,
+            mix.n, mix.m, mix.k, mix.index, mix.niter, mix.delta0, mix.delta, mix.Srow, mix.Scol,
+            (const float *)mix.S, mix.z, mix.V, mix.W, mix.gnrm, mix.Snrms));
 }
 
-void mix_backward_launcher_cuda(mix_t mix, float prox_lam, cudaStream_t stream)
+void mix_backward_sparse_launcher_cuda(mix_t mix, float prox_lam, int max_iter, float eps, cudaStream_t stream)
 {
-    int smem_size = (mix.m+mix.k*(1+MBUF_SIZE))*sizeof(float);
-    mix_backward<<<mix.b,WARP_SIZE*WARP_NUM,smem_size,stream>>>(prox_lam,
-           mix.n, mix.m, mix.k, mix.is_input, mix.index, mix.niter, 
-           mix.S, mix.dS, mix.z, mix.dz, mix.V, mix.U, mix.W, mix.Phi, mix.gnrm, mix.Snrms, mix.cache);
+    cudaMemsetAsync(mix.queue, 0, sizeof(int32_t), stream);
+    int smem_size = SPARSE_WARPS*mix.k*sizeof(float);
+    MIX_SWITCH_K(mix.k,
+        int grid = mix_persistent_grid(mix_backward_sparse<K>, SPARSE_WARPS*WARP_SIZE, smem_size, (mix.b+SPARSE_WARPS-1)/SPARSE_WARPS);
+        mix_backward_sparse<K><<<grid,SPARSE_WARPS*WARP_SIZE,smem_size,stream>>>(mix.b, mix.queue, mix.order, prox_lam, max_iter, eps,
+            mix.n, mix.m, mix.k, mix.is_input, mix.index, mix.niter, mix.bw_niter, mix.invalid, mix.Srow, mix.Scol,
+            (const float *)mix.S, mix.z, mix.dz, mix.V, mix.U, mix.Phi, mix.gnrm, mix.Snrms));
+    mix_dS_sparse<<<(mix.n+WARP_NUM-1)/WARP_NUM,WARP_SIZE*WARP_NUM,0,stream>>>(mix.b, mix.n, mix.m, mix.k,
+            mix.Srow, mix.Scol, mix.U, mix.V, mix.W, mix.Phi, mix.dS);
 }
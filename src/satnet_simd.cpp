@@ -0,0 +1,597 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "satnet_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_ARM 1
+// The SVE kernels need a compiler that accepts the SVE intrinsics inside
+// functions with a target attribute (GCC 12, Clang 18; older Clang refuses
+// arm_sve.h unless the whole extension is compiled for SVE), and the hardware
+// capabilities of Linux to detect SVE at run time.
+#if defined(__linux__) &&                                                      \
+    (defined(__ARM_FEATURE_SVE) ||                                             \
+     (defined(__clang__) && __clang_major__ >= 18) ||                          \
+     (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 12))
+#include <arm_sve.h>
+#include <sys/auxv.h>
+#define SIMD_SVE 1
+#ifndef HWCAP_SVE
+#define HWCAP_SVE (1 << 22)
+#endif
+#endif
+#endif
+
+/* ----------------------------- 16-bit formats ----------------------------- */
+
+// Rows of S stored as binary16 or bfloat16 are widened to FP32 once per
+// coordinate. The scalar conversions serve the SSE4.1 and scalar kernels
+// (the former may run on CPUs without F16C) and the row tails. BF selects
+// bfloat16.
+static inline float f16_to_f32(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = (h >> 10) & 0x1f,
+           f = h & 0x3ff, u;
+  if (e == 0x1f) // inf, nan
+    u = sign | 0x7f800000 | (f << 13);
+  else if (e)
+    u = sign | ((e + 112) << 23) | (f << 13);
+  else if (f) { // subnormal, renormalize
+    for (e = 113; !(f & 0x400); e--)
+      f <<= 1;
+    u = sign | (e << 23) | ((f & 0x3ff) << 13);
+  } else
+    u = sign;
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+static inline float bf16_to_f32(uint16_t h) {
+  uint32_t u = (uint32_t)h << 16;
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+template <int BF> static inline float to_f32(uint16_t h) {
+  return BF ? bf16_to_f32(h) : f16_to_f32(h);
+}
+
+#if SIMD_X86
+
+// The SSE4.1 kernels are the baseline the extension is compiled for
+// (-msse4.1). The AVX2 and AVX-512 kernels are compiled through function
+// target attributes instead of global flags, so they are only ever executed
+// after simd_select has checked CPUID for them.
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,f16c")))
+
+static inline float hsum128(__m128 s) {
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+/* ---------------------------------- SSE4.1 -------------------------------- */
+
+static float sdot_sse(const float *__restrict__ x, const float *__restrict__ y,
+                      int l) {
+  __m128 s = _mm_set1_ps(0);
+  int i = 0;
+  for (; i + 4 <= l; i += 4)
+    s = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)), s);
+  float s_ = hsum128(s);
+  for (; i < l; i++) /* clean-up loop */
+    s_ += x[i] * y[i];
+  return s_;
+}
+
+static void saxpy_sse(float *__restrict__ y, float a,
+                      const float *__restrict__ x, int l) {
+  __m128 const a_ = _mm_set1_ps(a);
+  int i = 0;
+  for (; i + 4 <= l; i += 4)
+    _mm_storeu_ps(y + i, _mm_add_ps(_mm_mul_ps(a_, _mm_loadu_ps(x + i)),
+                                    _mm_loadu_ps(y + i)));
+  for (; i < l; i++) /* clean-up loop */
+    y[i] += a * x[i];
+}
+
+static void sdotk_sse(const float *__restrict__ x, const float *__restrict__ Y,
+                      int l, int k, float *__restrict__ out) {
+  for (int kk = 0; kk < k; kk++)
+    out[kk] = sdot_sse(x, Y + kk * l, l);
+}
+
+template <int BF>
+static void load16_sse(const uint16_t *__restrict__ x, float *__restrict__ y,
+                       int l) {
+  for (int i = 0; i < l; i++)
+    y[i] = to_f32<BF>(x[i]);
+}
+
+/* ----------------------------------- AVX2 --------------------------------- */
+
+// maskload/maskstore lane masks for the last l%8 elements of a row
+static const int32_t avx2_tail_masks[8][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 0},         {-1, 0, 0, 0, 0, 0, 0, 0},
+    {-1, -1, 0, 0, 0, 0, 0, 0},       {-1, -1, -1, 0, 0, 0, 0, 0},
+    {-1, -1, -1, -1, 0, 0, 0, 0},     {-1, -1, -1, -1, -1, 0, 0, 0},
+    {-1, -1, -1, -1, -1, -1, 0, 0},   {-1, -1, -1, -1, -1, -1, -1, 0},
+};
+
+TARGET_AVX2 static inline __m256i avx2_tail_mask(int r) {
+  return _mm256_loadu_si256((const __m256i *)avx2_tail_masks[r]);
+}
+
+TARGET_AVX2 static inline float hsum256(__m256 s) {
+  return hsum128(
+      _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+}
+
+TARGET_AVX2 static float sdot_avx2(const float *__restrict__ x,
+                                   const float *__restrict__ y, int l) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= l; i += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+                         _mm256_loadu_ps(y + i + 8), s1);
+  }
+  if (i + 8 <= l) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    i += 8;
+  }
+  if (i < l) {
+    __m256i msk = avx2_tail_mask(l - i);
+    s1 = _mm256_fmadd_ps(_mm256_maskload_ps(x + i, msk),
+                         _mm256_maskload_ps(y + i, msk), s1);
+  }
+  return hsum256(_mm256_add_ps(s0, s1));
+}
+
+TARGET_AVX2 static void saxpy_avx2(float *__restrict__ y, float a,
+                                   const float *__restrict__ x, int l) {
+  __m256 const a_ = _mm256_set1_ps(a);
+  int i = 0;
+  for (; i + 8 <= l; i += 8)
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a_, _mm256_loadu_ps(x + i),
+                                            _mm256_loadu_ps(y + i)));
+  if (i < l) {
+    __m256i msk = avx2_tail_mask(l - i);
+    _mm256_maskstore_ps(y + i, msk,
+                        _mm256_fmadd_ps(a_, _mm256_maskload_ps(x + i, msk),
+                                        _mm256_maskload_ps(y + i, msk)));
+  }
+}
+
+// Four rows of Y share every load of x, so x is streamed k/4 times instead of
+// k times and the four independent accumulators hide the FMA latency.
+TARGET_AVX2 static void sdotk_avx2(const float *__restrict__ x,
+                                   const float *__restrict__ Y, int l, int k,
+                                   float *__restrict__ out) {
+  int kk = 0;
+  for (; kk + 4 <= k; kk += 4) {
+    const float *y0 = Y + kk * l, *y1 = y0 + l, *y2 = y1 + l, *y3 = y2 + l;
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= l; i += 8) {
+      __m256 x_ = _mm256_loadu_ps(x + i);
+      s0 = _mm256_fmadd_ps(x_, _mm256_loadu_ps(y0 + i), s0);
+      s1 = _mm256_fmadd_ps(x_, _mm256_loadu_ps(y1 + i), s1);
+      s2 = _mm256_fmadd_ps(x_, _mm256_loadu_ps(y2 + i), s2);
+      s3 = _mm256_fmadd_ps(x_, _mm256_loadu_ps(y3 + i), s3);
+    }
+    if (i < l) {
+      __m256i msk = avx2_tail_mask(l - i);
+      __m256 x_ = _mm256_maskload_ps(x + i, msk);
+      s0 = _mm256_fmadd_ps(x_, _mm256_maskload_ps(y0 + i, msk), s0);
+      s1 = _mm256_fmadd_ps(x_, _mm256_maskload_ps(y1 + i, msk), s1);
+      s2 = _mm256_fmadd_ps(x_, _mm256_maskload_ps(y2 + i, msk), s2);
+      s3 = _mm256_fmadd_ps(x_, _mm256_maskload_ps(y3 + i, msk), s3);
+    }
+    // transpose-reduce the four accumulators into [x'y0, x'y1, x'y2, x'y3]
+    __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+    _mm_storeu_ps(out + kk, _mm_add_ps(_mm256_castps256_ps128(h),
+                                       _mm256_extractf128_ps(h, 1)));
+  }
+  for (; kk < k; kk++)
+    out[kk] = sdot_avx2(x, Y + kk * l, l);
+}
+
+// 8 16-bit values -> __m256, bfloat16 is the upper half of an FP32
+template <int BF>
+TARGET_AVX2 static inline __m256 avx2_load8(const uint16_t *p) {
+  __m128i h = _mm_loadu_si128((const __m128i *)p);
+  if (BF)
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+  return _mm256_cvtph_ps(h);
+}
+
+template <int BF>
+TARGET_AVX2 static void load16_avx2(const uint16_t *__restrict__ x,
+                                    float *__restrict__ y, int l) {
+  int i = 0;
+  for (; i + 8 <= l; i += 8)
+    _mm256_storeu_ps(y + i, avx2_load8<BF>(x + i));
+  for (; i < l; i++)
+    y[i] = to_f32<BF>(x[i]);
+}
+
+/* --------------------------------- AVX-512 -------------------------------- */
+
+// Full horizontal sum inside the zmm register. (The maskz forms avoid the
+// _mm512_undefined_* operands that trip -Wuninitialized in GCC's headers.)
+TARGET_AVX512 static inline float hsum512(__m512 s) {
+  s = _mm512_add_ps(s, _mm512_maskz_shuffle_f32x4(0xffff, s, s, 0x4e));
+  s = _mm512_add_ps(s, _mm512_maskz_shuffle_f32x4(0xffff, s, s, 0xb1));
+  s = _mm512_add_ps(s, _mm512_maskz_permute_ps(0xffff, s, 0x4e));
+  s = _mm512_add_ps(s, _mm512_maskz_permute_ps(0xffff, s, 0xb1));
+  return _mm512_cvtss_f32(s);
+}
+
+TARGET_AVX512 static inline __mmask16 tail_mask(int r) {
+  return (__mmask16)((1u << r) - 1);
+}
+
+TARGET_AVX512 static float sdot_avx512(const float *__restrict__ x,
+                                       const float *__restrict__ y, int l) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= l; i += 32) {
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16),
+                         _mm512_loadu_ps(y + i + 16), s1);
+  }
+  for (; i < l; i += 16) {
+    __mmask16 msk = l - i >= 16 ? (__mmask16)0xffff : tail_mask(l - i);
+    s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(msk, x + i),
+                         _mm512_maskz_loadu_ps(msk, y + i), s0);
+  }
+  return hsum512(_mm512_add_ps(s0, s1));
+}
+
+TARGET_AVX512 static void saxpy_avx512(float *__restrict__ y, float a,
+                                       const float *__restrict__ x, int l) {
+  __m512 const a_ = _mm512_set1_ps(a);
+  int i = 0;
+  for (; i + 16 <= l; i += 16)
+    _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a_, _mm512_loadu_ps(x + i),
+                                            _mm512_loadu_ps(y + i)));
+  if (i < l) {
+    __mmask16 msk = tail_mask(l - i);
+    _mm512_mask_storeu_ps(
+        y + i, msk,
+        _mm512_fmadd_ps(a_, _mm512_maskz_loadu_ps(msk, x + i),
+                        _mm512_maskz_loadu_ps(msk, y + i)));
+  }
+}
+
+TARGET_AVX512 static void sdotk_avx512(const float *__restrict__ x,
+                                       const float *__restrict__ Y, int l,
+                                       int k, float *__restrict__ out) {
+  int kk = 0;
+  for (; kk + 4 <= k; kk += 4) {
+    const float *y0 = Y + kk * l, *y1 = y0 + l, *y2 = y1 + l, *y3 = y2 + l;
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    for (int i = 0; i < l; i += 16) {
+      __mmask16 msk = l - i >= 16 ? (__mmask16)0xffff : tail_mask(l - i);
+      __m512 x_ = _mm512_maskz_loadu_ps(msk, x + i);
+      s0 = _mm512_fmadd_ps(x_, _mm512_maskz_loadu_ps(msk, y0 + i), s0);
+      s1 = _mm512_fmadd_ps(x_, _mm512_maskz_loadu_ps(msk, y1 + i), s1);
+      s2 = _mm512_fmadd_ps(x_, _mm512_maskz_loadu_ps(msk, y2 + i), s2);
+      s3 = _mm512_fmadd_ps(x_, _mm512_maskz_loadu_ps(msk, y3 + i), s3);
+    }
+    out[kk + 0] = hsum512(s0);
+    out[kk + 1] = hsum512(s1);
+    out[kk + 2] = hsum512(s2);
+    out[kk + 3] = hsum512(s3);
+  }
+  for (; kk < k; kk++)
+    out[kk] = sdot_avx512(x, Y + kk * l, l);
+}
+
+template <int BF>
+TARGET_AVX512 static inline __m512 avx512_load16(const uint16_t *p) {
+  // maskz forms again, see hsum512
+  __m256i h = _mm256_loadu_si256((const __m256i *)p);
+  if (BF)
+    return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(
+        0xffff, _mm512_maskz_cvtepu16_epi32(0xffff, h), 16));
+  return _mm512_maskz_cvtph_ps(0xffff, h);
+}
+
+template <int BF>
+TARGET_AVX512 static void load16_avx512(const uint16_t *__restrict__ x,
+                                        float *__restrict__ y, int l) {
+  int i = 0;
+  for (; i + 16 <= l; i += 16)
+    _mm512_storeu_ps(y + i, avx512_load16<BF>(x + i));
+  for (; i < l; i++)
+    y[i] = to_f32<BF>(x[i]);
+}
+
+/* --------------------------------- dispatch ------------------------------- */
+
+static const simd_ops_t simd_sse = {"sse4.1",        sdot_sse,
+                                    saxpy_sse,       sdotk_sse,
+                                    load16_sse<0>,   load16_sse<1>};
+static const simd_ops_t simd_avx2 = {"avx2",          sdot_avx2,
+                                     saxpy_avx2,      sdotk_avx2,
+                                     load16_avx2<0>,  load16_avx2<1>};
+static const simd_ops_t simd_avx512 = {"avx512",         sdot_avx512,
+                                       saxpy_avx512,     sdotk_avx512,
+                                       load16_avx512<0>, load16_avx512<1>};
+
+// Pick the widest ISA reported by CPUID. SATNET_SIMD=sse4.1|avx2|avx512 can
+// cap the choice, e.g. to compare kernels on the same machine.
+static simd_ops_t simd_select() {
+  __builtin_cpu_init();
+  const char *cap = getenv("SATNET_SIMD");
+  bool has_avx2 = __builtin_cpu_supports("avx2") &&
+                  __builtin_cpu_supports("fma") &&
+                  __builtin_cpu_supports("f16c");
+  bool has_avx512 = has_avx2 && __builtin_cpu_supports("avx512f");
+
+  if (cap && !strcmp(cap, simd_sse.isa))
+    return simd_sse;
+  if (has_avx512 && !(cap && !strcmp(cap, simd_avx2.isa)))
+    return simd_avx512;
+  if (has_avx2)
+    return simd_avx2;
+  return simd_sse;
+}
+
+#elif SIMD_ARM
+
+// NEON is part of every AArch64 CPU and is the baseline there. The SVE
+// kernels are compiled through function target attributes like the AVX ones,
+// and only run once simd_select has found SVE in the hardware capabilities.
+// SVE is vector-length agnostic: the same code runs at 128 to 2048 bits, and
+// its predicated loads make every tail a masked iteration.
+
+/* ----------------------------------- NEON --------------------------------- */
+
+static float sdot_neon(const float *__restrict__ x, const float *__restrict__ y,
+                       int l) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 8 <= l; i += 8) {
+    s0 = vfmaq_f32(s0, vld1q_f32(x + i), vld1q_f32(y + i));
+    s1 = vfmaq_f32(s1, vld1q_f32(x + i + 4), vld1q_f32(y + i + 4));
+  }
+  if (i + 4 <= l) {
+    s0 = vfmaq_f32(s0, vld1q_f32(x + i), vld1q_f32(y + i));
+    i += 4;
+  }
+  float s_ = vaddvq_f32(vaddq_f32(s0, s1));
+  for (; i < l; i++) /* clean-up loop */
+    s_ += x[i] * y[i];
+  return s_;
+}
+
+static void saxpy_neon(float *__restrict__ y, float a,
+                       const float *__restrict__ x, int l) {
+  int i = 0;
+  for (; i + 4 <= l; i += 4)
+    vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), a));
+  for (; i < l; i++) /* clean-up loop */
+    y[i] += a * x[i];
+}
+
+// four rows of Y share every load of x, see sdotk_avx2
+static void sdotk_neon(const float *__restrict__ x, const float *__restrict__ Y,
+                       int l, int k, float *__restrict__ out) {
+  int kk = 0;
+  for (; kk + 4 <= k; kk += 4) {
+    const float *y0 = Y + kk * l, *y1 = y0 + l, *y2 = y1 + l, *y3 = y2 + l;
+    float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+    float32x4_t s2 = vdupq_n_f32(0), s3 = vdupq_n_f32(0);
+    int i = 0;
+    for (; i + 4 <= l; i += 4) {
+      float32x4_t x_ = vld1q_f32(x + i);
+      s0 = vfmaq_f32(s0, x_, vld1q_f32(y0 + i));
+      s1 = vfmaq_f32(s1, x_, vld1q_f32(y1 + i));
+      s2 = vfmaq_f32(s2, x_, vld1q_f32(y2 + i));
+      s3 = vfmaq_f32(s3, x_, vld1q_f32(y3 + i));
+    }
+    // pairwise-reduce the four accumulators into [x'y0, x'y1, x'y2, x'y3]
+    float32x4_t h = vpaddq_f32(vpaddq_f32(s0, s1), vpaddq_f32(s2, s3));
+    for (; i < l; i++) {
+      const float xi = x[i];
+      float32x4_t t = {xi * y0[i], xi * y1[i], xi * y2[i], xi * y3[i]};
+      h = vaddq_f32(h, t);
+    }
+    vst1q_f32(out + kk, h);
+  }
+  for (; kk < k; kk++)
+    out[kk] = sdot_neon(x, Y + kk * l, l);
+}
+
+// 4 16-bit values -> float32x4_t, bfloat16 is the upper half of an FP32
+template <int BF> static inline float32x4_t neon_load4(const uint16_t *p) {
+  uint16x4_t h = vld1_u16(p);
+  if (BF)
+    return vreinterpretq_f32_u32(vshlq_n_u32(vmovl_u16(h), 16));
+  return vcvt_f32_f16(vreinterpret_f16_u16(h));
+}
+
+template <int BF>
+static void load16_neon(const uint16_t *__restrict__ x, float *__restrict__ y,
+                        int l) {
+  int i = 0;
+  for (; i + 4 <= l; i += 4)
+    vst1q_f32(y + i, neon_load4<BF>(x + i));
+  for (; i < l; i++)
+    y[i] = to_f32<BF>(x[i]);
+}
+
+/* ----------------------------------- SVE ---------------------------------- */
+
+#if SIMD_SVE
+#define TARGET_SVE __attribute__((target("+sve")))
+
+// FP32 lanes of an SVE vector
+TARGET_SVE static int sve_lanes() { return (int)svcntw(); }
+
+TARGET_SVE static float sdot_sve(const float *__restrict__ x,
+                                 const float *__restrict__ y, int l) {
+  const int w = (int)svcntw();
+  svfloat32_t s0 = svdup_n_f32(0), s1 = svdup_n_f32(0);
+  const svbool_t all = svptrue_b32();
+  int i = 0;
+  for (; i + 2 * w <= l; i += 2 * w) {
+    s0 = svmla_f32_x(all, s0, svld1_f32(all, x + i), svld1_f32(all, y + i));
+    s1 = svmla_f32_x(all, s1, svld1_f32(all, x + i + w),
+                     svld1_f32(all, y + i + w));
+  }
+  for (; i < l; i += w) {
+    svbool_t pg = svwhilelt_b32(i, l);
+    s0 = svmla_f32_m(pg, s0, svld1_f32(pg, x + i), svld1_f32(pg, y + i));
+  }
+  return svaddv_f32(all, svadd_f32_x(all, s0, s1));
+}
+
+TARGET_SVE static void saxpy_sve(float *__restrict__ y, float a,
+                                 const float *__restrict__ x, int l) {
+  const int w = (int)svcntw();
+  for (int i = 0; i < l; i += w) {
+    svbool_t pg = svwhilelt_b32(i, l);
+    svst1_f32(pg, y + i,
+              svmla_n_f32_x(pg, svld1_f32(pg, y + i), svld1_f32(pg, x + i), a));
+  }
+}
+
+TARGET_SVE static void sdotk_sve(const float *__restrict__ x,
+                                 const float *__restrict__ Y, int l, int k,
+                                 float *__restrict__ out) {
+  const int w = (int)svcntw();
+  const svbool_t all = svptrue_b32();
+  int kk = 0;
+  for (; kk + 4 <= k; kk += 4) {
+    const float *y0 = Y + kk * l, *y1 = y0 + l, *y2 = y1 + l, *y3 = y2 + l;
+    svfloat32_t s0 = svdup_n_f32(0), s1 = svdup_n_f32(0);
+    svfloat32_t s2 = svdup_n_f32(0), s3 = svdup_n_f32(0);
+    for (int i = 0; i < l; i += w) {
+      // inactive lanes load zeros, so the tail adds nothing
+      svbool_t pg = svwhilelt_b32(i, l);
+      svfloat32_t x_ = svld1_f32(pg, x + i);
+      s0 = svmla_f32_x(all, s0, x_, svld1_f32(pg, y0 + i));
+      s1 = svmla_f32_x(all, s1, x_, svld1_f32(pg, y1 + i));
+      s2 = svmla_f32_x(all, s2, x_, svld1_f32(pg, y2 + i));
+      s3 = svmla_f32_x(all, s3, x_, svld1_f32(pg, y3 + i));
+    }
+    out[kk + 0] = svaddv_f32(all, s0);
+    out[kk + 1] = svaddv_f32(all, s1);
+    out[kk + 2] = svaddv_f32(all, s2);
+    out[kk + 3] = svaddv_f32(all, s3);
+  }
+  for (; kk < k; kk++)
+    out[kk] = sdot_sve(x, Y + kk * l, l);
+}
+
+// The 16-bit values are loaded zero-extended into the 32-bit lanes: bfloat16
+// is then shifted into the upper half, and binary16 converted from the even
+// (lower) half of each lane. (Plain functions rather than a template over BF:
+// the SVE types are sizeless and stay out of templates and ?: expressions.)
+TARGET_SVE static void load_f16_sve(const uint16_t *__restrict__ x,
+                                    float *__restrict__ y, int l) {
+  const int w = (int)svcntw();
+  for (int i = 0; i < l; i += w) {
+    svbool_t pg = svwhilelt_b32(i, l);
+    svuint32_t h = svld1uh_u32(pg, x + i);
+    svst1_f32(pg, y + i, svcvt_f32_f16_x(pg, svreinterpret_f16_u32(h)));
+  }
+}
+
+TARGET_SVE static void load_bf16_sve(const uint16_t *__restrict__ x,
+                                     float *__restrict__ y, int l) {
+  const int w = (int)svcntw();
+  for (int i = 0; i < l; i += w) {
+    svbool_t pg = svwhilelt_b32(i, l);
+    svuint32_t h = svld1uh_u32(pg, x + i);
+    svst1_f32(pg, y + i, svreinterpret_f32_u32(svlsl_n_u32_x(pg, h, 16)));
+  }
+}
+#endif
+
+/* --------------------------------- dispatch ------------------------------- */
+
+static const simd_ops_t simd_neon = {"neon",         sdot_neon,
+                                     saxpy_neon,     sdotk_neon,
+                                     load16_neon<0>, load16_neon<1>};
+#if SIMD_SVE
+static const simd_ops_t simd_sve = {"sve",         sdot_sve,
+                                    saxpy_sve,     sdotk_sve,
+                                    load_f16_sve,  load_bf16_sve};
+#endif
+
+// SVE when the hardware has it and its vectors are wider than NEON's (e.g.
+// 256 bits on Graviton3); at 128 bits NEON does the same work without the
+// predication. SATNET_SIMD=neon|sve overrides the choice, e.g. to compare
+// kernels on the same machine.
+static simd_ops_t simd_select() {
+#if SIMD_SVE
+  const char *cap = getenv("SATNET_SIMD");
+  if (getauxval(AT_HWCAP) & HWCAP_SVE) {
+    if (cap && !strcmp(cap, simd_sve.isa))
+      return simd_sve;
+    if (sve_lanes() > 4 && !(cap && !strcmp(cap, simd_neon.isa)))
+      return simd_sve;
+  }
+#endif
+  return simd_neon;
+}
+
+#else
+
+/* ---------------------------------- scalar -------------------------------- */
+
+// Any other architecture: plain loops, left to the compiler's vectorizer.
+
+static float sdot_scalar(const float *__restrict__ x,
+                         const float *__restrict__ y, int l) {
+  float s = 0;
+  for (int i = 0; i < l; i++)
+    s += x[i] * y[i];
+  return s;
+}
+
+static void saxpy_scalar(float *__restrict__ y, float a,
+                         const float *__restrict__ x, int l) {
+  for (int i = 0; i < l; i++)
+    y[i] += a * x[i];
+}
+
+static void sdotk_scalar(const float *__restrict__ x,
+                         const float *__restrict__ Y, int l, int k,
+                         float *__restrict__ out) {
+  for (int kk = 0; kk < k; kk++)
+    out[kk] = sdot_scalar(x, Y + kk * l, l);
+}
+
+template <int BF>
+static void load16_scalar(const uint16_t *__restrict__ x,
+                          float *__restrict__ y, int l) {
+  for (int i = 0; i < l; i++)
+    y[i] = to_f32<BF>(x[i]);
+}
+
+static simd_ops_t simd_select() {
+  static const simd_ops_t simd_scalar = {"scalar",         sdot_scalar,
+                                         saxpy_scalar,     sdotk_scalar,
+                                         load16_scalar<0>, load16_scalar<1>};
+  return simd_scalar;
+}
+
+#endif
+
+const simd_ops_t simd = simd_select();
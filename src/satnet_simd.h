@@ -0,0 +1,35 @@
+#pragma once
+
+// Vector kernels used by the CPU mixing method. Every entry has an SSE4.1,
+// AVX2 and AVX-512 implementation on x86 and a NEON and SVE one on AArch64
+// (plain loops elsewhere); the widest one supported by the host is picked
+// once at module load (see simd_select in satnet_simd.cpp), so a single build
+// runs on any machine of its architecture.
+//
+// Any length and alignment is accepted: the main loops use unaligned loads and
+// the tails are finished with masked loads (AVX2/AVX-512), predicated ones
+// (SVE) or a scalar epilogue (SSE, NEON). Rows starting on a 64-byte boundary
+// still run fastest, which is why MixingFunc pads the clause dimension m
+// internally on CPU.
+
+#include <stdint.h>
+
+// 16-bit storage formats for S: the raw bits of an IEEE binary16 or a
+// bfloat16 value.
+struct half_t { uint16_t bits; };
+struct bfloat16_t { uint16_t bits; };
+
+typedef struct simd_ops_t {
+  const char *isa;
+  // returns x'y
+  float (*dot)(const float *x, const float *y, int l);
+  // y = a*x + y
+  void (*axpy)(float *y, float a, const float *x, int l);
+  // out[kk] = x'Y[kk*l:(kk+1)*l] for the k rows of the row-major k*l matrix Y
+  void (*dotk)(const float *x, const float *Y, int l, int k, float *out);
+  // y = float(x) for binary16 and bfloat16 x
+  void (*load_f16)(const uint16_t *x, float *y, int l);
+  void (*load_bf16)(const uint16_t *x, float *y, int l);
+} simd_ops_t;
+
+extern const simd_ops_t simd;